@@ -16,7 +16,7 @@
 #ifndef __CHECKPOINT_CPT_ENV__
 #define __CHECKPOINT_CPT_ENV__
 
-enum { GZ_FORMAT, ZSTD_FORMAT };
+enum { GZ_FORMAT, ZSTD_FORMAT, SPARSE_FORMAT };
 
 extern char *output_base_dir;
 extern char *config_name;
@@ -26,5 +26,8 @@ extern int cpt_id;
 extern char *cpt_file;
 extern char *restorer;
 extern char compress_file_format;
+extern int cpt_compress_threads;
+extern int cpt_async_dumps;
+extern int cpt_delta_chain;
 
 #endif
@@ -22,6 +22,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <sys/types.h>
 
 
 class Serializer
@@ -34,6 +36,12 @@ class Serializer
 
     void serializeRegs();
 
+    void serializeAsync(uint64_t inst_count);
+
+    void waitDumps(size_t max_in_flight);
+
+    void chooseDeltaBase(uint64_t inst_count);
+
     explicit Serializer();
 
     void init();
@@ -41,6 +49,8 @@ class Serializer
     bool shouldTakeCpt(uint64_t num_insts);
     bool instrsCouldTakeCpt(uint64_t num_insts);
 
+    uint64_t nextCptPoint();
+
     void notify_taken(uint64_t i);
 
     uint64_t next_index();
@@ -62,6 +72,12 @@ class Serializer
     std::map<uint64_t, double> simpoint2Weights;
 
     uint64_t nextUniformPoint;
+
+    std::vector<pid_t> dumpPids;
+
+    std::string prevCptPath;
+    std::string deltaBase;  // relative path of the base of the delta, empty for a full checkpoint
+    int deltaChainLen{0};
 };
 
 extern Serializer serializer;
@@ -0,0 +1,86 @@
+/***************************************************************************************
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CHECKPOINT_SPARSE_CPT_H__
+#define __CHECKPOINT_SPARSE_CPT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A sparse checkpoint only keeps the non-zero pages of guest memory:
+//
+//   header | register block | compressed runs | run index
+//
+// A run is up to SPARSE_CPT_MAX_RUN contiguous non-zero pages compressed
+// into its own zstd frame, so the runs can be decompressed in parallel and
+// in any order. The pages not in any run are zero. The register block is a
+// copy of the registers which serializeRegs() puts into guest memory, so
+// they can be read without decompressing anything. All fields are little
+// endian.
+//
+// A delta checkpoint only keeps the pages written since its base
+// checkpoint, zero or not, and the pages not in any run are the ones in
+// the base. The path of the base, relative to the directory of the delta,
+// is stored after the register block. Restoring a delta restores the
+// chain of its bases first.
+
+#define SPARSE_CPT_MAGIC "NEMUSCPT"
+#define SPARSE_CPT_VERSION 2
+#define SPARSE_CPT_PAGE_SHIFT 12
+#define SPARSE_CPT_PAGE_SIZE (1ul << SPARSE_CPT_PAGE_SHIFT)
+#define SPARSE_CPT_MAX_RUN 256
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_shift;
+  uint64_t mem_size;        // bytes of guest memory in the checkpoint
+  uint64_t regs_mem_offset; // where the register block is in guest memory
+  uint64_t regs_offset;     // file offset of the register block
+  uint64_t regs_size;
+  uint64_t nr_runs;
+  uint64_t index_offset;    // file offset of the run index
+  // version 2
+  uint64_t base_offset;     // file offset of the base path
+  uint64_t base_size;       // 0 if it is not a delta
+} SparseCptHeader;
+
+typedef struct {
+  uint64_t mem_offset;      // offset of the first page in guest memory
+  uint64_t nr_pages;
+  uint64_t file_offset;     // file offset of the zstd frame
+  uint64_t file_size;
+} SparseCptRun;
+
+bool is_sparse_cpt_file(const char *filename);
+// Dump a full checkpoint if base is NULL, or else a delta of the pages for
+// which page_dirty(mem_offset) is true. nr_thread <= 0 means all host CPUs.
+void sparse_cpt_dump(FILE *fp, const uint8_t *mem, uint64_t size,
+    uint64_t regs_mem_offset, uint64_t regs_size,
+    const char *base, bool (*page_dirty)(uint64_t mem_offset), int nr_thread);
+long sparse_cpt_load(const char *filename, uint8_t *mem, uint64_t size, int nr_thread);
+// decompress the lazily restored runs in [start, start + len) of host memory
+void sparse_cpt_lazy_fill(uint8_t *start, uint64_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
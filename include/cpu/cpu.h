@@ -28,6 +28,12 @@ enum {
 };
 
 void cpu_exec(uint64_t n);
+void hart_exec(uint64_t n);
+#ifdef CONFIG_MULTI_HART
+extern HART_LOCAL int g_hart_id;
+void harts_exec(uint64_t n);
+void harts_statistic();
+#endif
 __attribute__((noreturn)) void longjmp_exec(int cause);
 __attribute__((noreturn)) void longjmp_exception(int ex_cause);
 
@@ -37,12 +43,15 @@ enum {
 };
 void set_sys_state_flag(int flag);
 void mmu_tlb_flush(vaddr_t vaddr);
+void hart_set_pc(vaddr_t pc);
 
 struct Decode;
 void save_globals(struct Decode *s);
 void fetch_decode(struct Decode *s, vaddr_t pc);
+bool fuse_decode(struct Decode *prev, struct Decode *s);
 void lightqs_take_reg_snapshot();
 void clint_take_snapshot();
+void update_clint();
 void lightqs_take_spec_reg_snapshot();
 void clint_take_spec_snapshot();
 uint64_t lightqs_restore_reg_snapshot(uint64_t n);
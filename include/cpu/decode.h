@@ -44,6 +44,13 @@ enum {
   INSTR_TYPE_I, // indirect
 };
 
+// hints for the return address stack
+enum {
+  RAS_HINT_NONE,
+  RAS_HINT_PUSH, // call
+  RAS_HINT_POP,  // return
+};
+
 typedef struct Decode {
   union {
     struct {
@@ -60,9 +67,15 @@ typedef struct Decode {
   IFDEF (CONFIG_PERF_OPT, const void *EHelper);
   IFNDEF(CONFIG_PERF_OPT, void (*EHelper)(struct Decode *));
   Operand dest, src1, src2;
-  vaddr_t jnpc;
+  union {
+    vaddr_t jnpc;
+    struct tc_ic_t *ic; // inline cache of indirect jump targets, only used by tcache
+    uint32_t br_cnt[2]; // counters of not taken and taken, only used by tcache
+    const void *jit_code; // host code from this instruction, only used by the JIT
+  };
   uint16_t idx_in_bb; // the number of instruction in the basic block, start from 1
   uint8_t type;
+  uint8_t ras_hint;
   ISADecodeInfo isa;
   IFDEF(CONFIG_DEBUG, char logbuf[80]);
   #ifdef CONFIG_RVV
@@ -0,0 +1,33 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_JIT_H__
+#define __CPU_JIT_H__
+
+#include <cpu/decode.h>
+
+void jit_init(const void **exec_table, const void *exec_jit);
+// Each chunk of the tcache has its own code buffer, which is reset when the
+// chunk is allocated, so host code is freed together with its instructions.
+void jit_code_init(int nr_chunk, int chunk_size);
+void jit_chunk_reset(int chunk);
+// translate the runs of supported instructions in [start, end) of a chunk,
+// which is skipped if it is already translated
+void jit_translate(int chunk, Decode *start, Decode *end);
+// restore the EHelper of an instruction copied from a translated run
+void jit_restore(Decode *s);
+void jit_statistic();
+
+#endif
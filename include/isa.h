@@ -29,16 +29,18 @@ typedef concat(__ISA__, _ISADecodeInfo) ISADecodeInfo;
 // monitor
 extern char isa_logo[];
 void init_isa();
+void init_isa_hart(int hartid);
 
 // reg
-extern CPU_state cpu;
-extern rtlreg_t csr_array[4096];
+extern HART_LOCAL CPU_state cpu;
+extern HART_LOCAL rtlreg_t csr_array[4096];
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
 
 // exec
 struct Decode;
 int isa_fetch_decode(struct Decode *s);
+int isa_fuse(struct Decode *prev, struct Decode *s);
 void isa_hostcall(uint32_t id, rtlreg_t *dest, const rtlreg_t *src1,
     const rtlreg_t *src2, word_t imm);
 
@@ -53,6 +55,7 @@ int isa_mmu_state();
 int isa_mmu_check(vaddr_t vaddr, int len, int type);
 #endif
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type);
+void isa_mmu_statistic();
 bool isa_pmp_check_permission(paddr_t addr, int len, int type, int mode);
 
 // interrupt
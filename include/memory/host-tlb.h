@@ -23,5 +23,22 @@ word_t hosttlb_read(struct Decode *s, vaddr_t vaddr, int len, int type);
 void hosttlb_write(struct Decode *s, vaddr_t vaddr, int len, word_t data);
 void hosttlb_init();
 void hosttlb_flush(vaddr_t vaddr);
+void hosttlb_flush_write();
+void hosttlb_set_context(uint64_t space, uint64_t gspace, uint64_t priv);
+void hosttlb_flush_context(uint64_t space_mask, uint64_t space);
+extern HART_LOCAL int hosttlb_page_shift;
+extern HART_LOCAL int hosttlb_leaf_shift;
+
+#ifdef CONFIG_ENGINE_JIT
+// For the lookup inlined by the JIT. The entries of the read and write
+// tables are {host offset, tag} of 16 bytes, which are indexed and tagged
+// as in hosttlb_read().
+typedef struct {
+  const void *rtlb, *wtlb;
+  const vaddr_t *ctx, *ctx_set;
+  int size;
+} HostTLBJitInfo;
+void hosttlb_jit_info(HostTLBJitInfo *info);
+#endif
 
 #endif
@@ -32,6 +32,29 @@ extern unsigned int PMEM_HARTID;
 
 void init_mem();
 
+// how the guest physical memory is backed, see allocate_memory_with_mmap()
+enum { PMEM_HUGEPAGE_NONE, PMEM_HUGEPAGE_THP, PMEM_HUGEPAGE_HUGETLB };
+// apply the hugepage and NUMA policy of guest memory to the pages mapped at
+// [addr, addr + len), which are going to back part of it
+void pmem_apply_policy(void *addr, size_t len);
+
+#ifdef CONFIG_PMEM_DIRTY_TRACK
+// pages of pmem written since the last pmem_dirty_clear()
+#define PMEM_DIRTY_NONE ((uint64_t)-1)
+void pmem_dirty_mark(paddr_t addr, size_t len); // for the writes not by paddr_write()
+bool pmem_dirty_test(paddr_t addr);
+uint64_t pmem_dirty_next(paddr_t addr); // the first dirty page from addr, or PMEM_DIRTY_NONE
+uint64_t pmem_dirty_count();
+void pmem_dirty_clear();
+#endif
+
+#ifdef CONFIG_PMEM_SNAPSHOT
+// copy-on-write snapshot of the guest physical memory and cpu, see snapshot.c
+void pmem_snapshot_take();
+void pmem_snapshot_reset();
+void pmem_snapshot_drop();
+#endif
+
 /* convert the guest physical address in the guest program to host virtual address in NEMU */
 uint8_t* guest_to_host(paddr_t paddr);
 /* convert the host virtual address in NEMU to guest physical address in the guest program */
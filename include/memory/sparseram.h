@@ -78,14 +78,27 @@ class SparseRam
         u_int8_t * blk;
     } sp_mm_blk;
     
+    // The blocks are kept in a radix table indexed by the block number. The
+    // root table is allocated with the SparseRam, and the tables below it
+    // are allocated when a block under them is written.
+    static const int RADIX_LEAF_BITS = 12;
+    static const int RADIX_MID_BITS = 12;
+    static const int RADIX_ROOT_BITS = 16;
+    typedef u_int8_t **leaf_table;
+    typedef leaf_table *mid_table;
+
 public:
     unsigned block_size;
-    std::map<paddr_t, u_int8_t *> mem;
+    unsigned block_shift;
+    size_t nr_blk = 0;
     std::map<std::string, sp_mm_blk *> big_block;
 
     ~SparseRam();
     SparseRam(u_int block_count = 4, u_int chunk_size=1024){
         this->block_size = block_count * chunk_size;
+        vassert((this->block_size & (this->block_size - 1)) == 0, "block_size should be a power of 2");
+        this->block_shift = __builtin_ctz(this->block_size);
+        this->root = (mid_table *)calloc(1ul << RADIX_ROOT_BITS, sizeof(mid_table));
         DEBUG("init SparseRam with block_size= %.2f kB (chunk_size=%d)", float(this->block_size)/1024.0, chunk_size);
     }
  
@@ -94,6 +107,7 @@ public:
 
     void read(paddr_t addr, size_t len, void* bytes);
     void write(paddr_t addr, size_t len, const void* bytes);
+    void *host_addr(paddr_t addr, size_t len);
     bool add_blk(char *name, paddr_t start, paddr_t end);
     void *blk_host_addr(char *name);
 
@@ -109,11 +123,13 @@ public:
     void print_info();
 
 private:
-    u_int max_cache_size = 5;
-    std::map<paddr_t, std::tuple<u_int8_t*, u_long>> cache;
-    bool _fast_count(paddr_t index);
-    u_int8_t *_fast_mem(paddr_t index);
-    void __update_cache(paddr_t index, u_int8_t*m);
+    mid_table *root;
+    // the last block found, most accesses are to the same block
+    paddr_t last_index = -1;
+    u_int8_t *last_blk = NULL;
+    u_int8_t *_blk_lookup(paddr_t index);
+    u_int8_t *_blk_alloc(paddr_t index);
+    void _for_each_blk(std::function<void (paddr_t index, u_int8_t *blk)> handler);
     sp_mm_blk *_blk_find(paddr_t addr);
     bool _blk_read(paddr_t addr, size_t len, void* bytes);
     bool _blk_write(paddr_t addr, size_t len, const void* bytes);
@@ -135,6 +151,7 @@ extern "C"
     void   sparse_mem_write(void* self, paddr_t addr, size_t len, const void* bytes);
     void   sparse_mem_wwrite(void* self, paddr_t addr, int len, word_t data);
     word_t sparse_mem_wread(void *self, paddr_t addr, int len);
+    void*  sparse_mem_host_addr(void *self, paddr_t addr, size_t len);
     void   sparse_mem_info(void* self);
     void   sparse_mem_copy(void *dst, void *src);
     void*  sparse_mem_blk_get(void *self, char *name);
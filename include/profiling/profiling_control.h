@@ -30,5 +30,7 @@ extern bool workload_loaded;
 extern bool donot_skip_boot;
 
 void reset_inst_counters();
+// call it after changing any state above
+void update_per_bb_hook();
 
 #endif // __PROFILING_CONTROL_H__
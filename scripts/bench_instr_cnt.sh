@@ -0,0 +1,82 @@
+#!/bin/bash
+#***************************************************************************************
+# Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# Compare the simulation speed of NEMU with and without instruction counting.
+#
+# usage: bench_instr_cnt.sh <defconfig> <image> [runs] [extra NEMU args]
+#
+# NEMU is built twice from <defconfig>, with CONFIG_ENABLE_INSTR_CNT and with
+# CONFIG_DISABLE_INSTR_CNT. Both builds run <image> in batch mode, and the best
+# host time of [runs] runs is reported. The build without instruction counting
+# does not report the number of guest instructions, so the number reported by
+# the other build is used to compute MIPS for both.
+
+set -e
+
+DEFCONFIG=$1
+IMAGE=$2
+RUNS=${3:-5}
+shift 3 2>/dev/null || shift $#
+if [ -z "$DEFCONFIG" ] || [ -z "$IMAGE" ]; then
+  echo "usage: $0 <defconfig> <image> [runs] [extra NEMU args]"
+  exit 1
+fi
+
+NEMU_HOME=${NEMU_HOME:-$(cd $(dirname $0)/.. && pwd)}
+OUT=$(mktemp -d)
+trap "rm -rf $OUT" EXIT
+
+# build_nemu <enable|disable>
+build_nemu() {
+  make -C $NEMU_HOME -s $DEFCONFIG
+  if [ $1 == enable ]; then
+    sed -i -e 's/^CONFIG_DISABLE_INSTR_CNT=y/# CONFIG_DISABLE_INSTR_CNT is not set/' \
+           -e '/CONFIG_ENABLE_INSTR_CNT/d' $NEMU_HOME/.config
+    echo "CONFIG_ENABLE_INSTR_CNT=y" >> $NEMU_HOME/.config
+  else
+    sed -i -e '/CONFIG_DISABLE_INSTR_CNT/d' -e '/CONFIG_ENABLE_INSTR_CNT/d' $NEMU_HOME/.config
+    echo "CONFIG_DISABLE_INSTR_CNT=y" >> $NEMU_HOME/.config
+  fi
+  (cd $NEMU_HOME && tools/kconfig/build/conf -s --syncconfig Kconfig)
+  make -C $NEMU_HOME -s clean
+  make -C $NEMU_HOME -s -j$(nproc)
+  cp $NEMU_HOME/build/*-nemu-interpreter $OUT/nemu-$1
+}
+
+# run_nemu <enable|disable> [extra NEMU args], print the best host time in us
+run_nemu() {
+  local mode=$1 best=
+  shift
+  for i in $(seq $RUNS); do
+    local t=$($OUT/nemu-$mode -b "$@" $IMAGE 2>&1 | grep -o "host time spent = [0-9,]*" | tr -dc '0-9')
+    if [ -z "$best" ] || [ $t -lt $best ]; then best=$t; fi
+  done
+  echo $best
+}
+
+build_nemu enable
+build_nemu disable
+
+INSTR=$($OUT/nemu-enable -b "$@" $IMAGE 2>&1 | grep -o "total guest instructions = [0-9,]*" | tr -dc '0-9')
+T_EN=$(run_nemu enable "$@")
+T_DIS=$(run_nemu disable "$@")
+
+echo "guest instructions: $INSTR"
+awk -v n=$INSTR -v en=$T_EN -v dis=$T_DIS 'BEGIN {
+  printf("ENABLE_INSTR_CNT:  %8d us, %8.1f MIPS\n", en, n / en);
+  printf("DISABLE_INSTR_CNT: %8d us, %8.1f MIPS\n", dis, n / dis);
+  printf("MIPS of ENABLE_INSTR_CNT relative to DISABLE_INSTR_CNT: %+.1f%%\n", (dis / en - 1) * 100);
+}'
@@ -0,0 +1,65 @@
+#!/bin/bash
+#***************************************************************************************
+# Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# Compare the ways to back the guest physical memory.
+#
+# usage: bench_pmem.sh <image> [runs] [extra NEMU args]
+#
+# The NEMU built in $NEMU_HOME/build runs <image> in batch mode with every
+# --pmem-hugepage mode, with and without --pmem-populate. The time to allocate
+# the guest memory and the best host time of [runs] runs are reported. Pass
+# --pmem-numa-node=N as an extra argument to bind the memory to a NUMA node.
+# NEMU falls back to normal pages if no huge pages are reserved for hugetlb.
+
+set -e
+
+IMAGE=$1
+RUNS=${2:-5}
+shift 2 2>/dev/null || shift $#
+if [ -z "$IMAGE" ]; then
+  echo "usage: $0 <image> [runs] [extra NEMU args]"
+  exit 1
+fi
+
+NEMU_HOME=${NEMU_HOME:-$(cd $(dirname $0)/.. && pwd)}
+NEMU=$(ls $NEMU_HOME/build/*-nemu-interpreter | head -n 1)
+
+# run_nemu [NEMU args], print the best allocation time in ms, the best host
+# time in us and the number of guest instructions
+run_nemu() {
+  local best_alloc= best= instr=
+  for i in $(seq $RUNS); do
+    local out=$($NEMU -b "$@" $IMAGE 2>&1)
+    local a=$(echo "$out" | grep -o "memory with .* in [0-9]* ms" | grep -o "[0-9]* ms" | tr -dc '0-9')
+    local t=$(echo "$out" | grep -o "host time spent = [0-9,]*" | tr -dc '0-9')
+    instr=$(echo "$out" | grep -o "total guest instructions = [0-9,]*" | tr -dc '0-9')
+    if [ -z "$best_alloc" ] || [ $a -lt $best_alloc ]; then best_alloc=$a; fi
+    if [ -z "$best" ] || [ $t -lt $best ]; then best=$t; fi
+  done
+  echo $best_alloc $best ${instr:-0}
+}
+
+printf "%-10s %-9s %10s %12s %10s\n" hugepage populate "alloc(ms)" "host(us)" MIPS
+for mode in none thp hugetlb; do
+  for populate in no yes; do
+    args="--pmem-hugepage=$mode"
+    [ $populate == yes ] && args="$args --pmem-populate"
+    read alloc t instr <<< $(run_nemu $args "$@")
+    awk -v m=$mode -v p=$populate -v a=$alloc -v t=$t -v n=$instr 'BEGIN {
+      printf("%-10s %-9s %10d %12d %10.1f\n", m, p, a, t, n / t);
+    }'
+  done
+done
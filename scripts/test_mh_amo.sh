@@ -0,0 +1,142 @@
+#!/bin/bash
+#***************************************************************************************
+# Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# Check that AMOs and LR/SC of all harts are atomic with address translation.
+#
+# usage: test_mh_amo.sh [riscv64 NEMU binary built with CONFIG_MULTI_HART]
+#
+# Every hart enables Sv39, where VA 0x40000000 is mapped to PA 0x80000000
+# by a gigapage, and increments three counters in the middle of a page in
+# a loop, by amoadd.d, amoadd.w and LR/SC. Hart 0 waits for the others and
+# ends with
+#
+#   a0 = (c0 ^ n) | (c1 ^ n) | (c2 ^ n) | (word at the page base ^ magic)
+#
+# where n = harts * iterations, so it must end with "nemu_trap case 0". A
+# lost increment of the counter of finished harts keeps hart 0 waiting, so
+# NEMU is killed after TIMEOUT seconds.
+
+NEMU_HOME=${NEMU_HOME:-$(cd $(dirname $0)/.. && pwd)}
+NEMU=${1:-$NEMU_HOME/build/riscv64-nemu-interpreter}
+NR_HARTS=$(sed -n 's/^CONFIG_NR_HARTS=//p' $NEMU_HOME/.config)
+if [ -z "$NR_HARTS" ]; then
+  echo "CONFIG_MULTI_HART is not set in $NEMU_HOME/.config"
+  exit 1
+fi
+TIMEOUT=${TIMEOUT:-60}
+OUT=$(mktemp -d)
+trap "rm -rf $OUT" EXIT
+
+python3 - $NR_HARTS $OUT/amo.bin <<'EOF'
+import struct, sys
+nr_harts, iters, magic = int(sys.argv[1]), 20000, 0x5a5
+zero, ra, t0, t1, t2, s0, s1, a0, a1, a2, a3, a4, s5 = 0, 1, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 21
+
+def i_type(op, rd, f3, rs1, imm): return ((imm & 0xfff) << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op
+def r_type(op, rd, f3, rs1, rs2, f7): return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op
+def u_type(op, rd, imm): return (imm & 0xfffff000) | (rd << 7) | op
+def b_type(f3, rs1, rs2, off):
+  return (((off >> 12) & 1) << 31) | (((off >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15) | \
+         (f3 << 12) | (((off >> 1) & 0xf) << 8) | (((off >> 11) & 1) << 7) | 0x63
+def amo(f5, w, rd, rs1, rs2): return r_type(0x2f, rd, 3 if w == 8 else 2, rs1, rs2, f5 << 2)
+
+code, labels, fixups = [], {}, []
+def emit(*w): code.extend(w)
+def label(name): labels[name] = len(code) * 4
+def branch(f3, rs1, rs2, name): fixups.append((len(code), f3, rs1, rs2, name)); code.append(0)
+def li(rd, imm):  # imm < 2^31
+  hi, lo = (imm + 0x800) & ~0xfff, imm & 0xfff
+  emit(u_type(0x37, rd, hi), i_type(0x1b, rd, 0, rd, lo))  # lui; addiw
+def csrw(csr, rs): emit(i_type(0x73, 0, 1, rs, csr))
+def addi(rd, rs, imm): emit(i_type(0x13, rd, 0, rs, imm))
+def ld(rd, rs, imm): emit(i_type(0x03, rd, 3, rs, imm))
+def lwu(rd, rs, imm): emit(i_type(0x03, rd, 6, rs, imm))
+def xor(rd, rs1, rs2): emit(r_type(0x33, rd, 4, rs1, rs2, 0))
+def or_(rd, rs1, rs2): emit(r_type(0x33, rd, 6, rs1, rs2, 0))
+
+DATA, ROOT = 0x1000, 0x2000  # offsets of the data page and the page table in the image
+C0, C1, C2, DONE = 0x100, 0x108, 0x110, 0x118
+
+# M-mode
+addi(t0, zero, -1); csrw(0x3b0, t0)                  # pmpaddr0
+addi(t0, zero, 0x1f); csrw(0x3a0, t0)                # pmpcfg0
+emit(0x00000297); fixups.append((len(code), 'addi_label', t0, t0, 'fail')); code.append(0)
+csrw(0x305, t0)                                      # mtvec = fail
+emit(i_type(0x73, s5, 2, 0, 0xf14))                  # csrr s5, mhartid
+addi(t0, zero, 8); emit(i_type(0x13, t0, 1, t0, 60)) # slli t0, t0, 60
+li(t1, (0x80000000 + ROOT) >> 12); or_(t0, t0, t1)
+csrw(0x180, t0)                                      # satp = Sv39
+li(t0, 0x1800); emit(i_type(0x73, 0, 3, t0, 0x300))  # csrc mstatus, MPP
+li(t0, 0x800); emit(i_type(0x73, 0, 2, t0, 0x300))   # csrs mstatus, MPP = S
+emit(0x00000297); fixups.append((len(code), 'addi_label', t0, t0, 'smode')); code.append(0)
+csrw(0x341, t0)                                      # mepc
+emit(0x30200073)                                     # mret
+# S-mode
+label('smode')
+emit(0x12000073)                                     # sfence.vma
+li(s0, 0x40000000 + DATA)
+li(s1, iters)
+addi(t0, zero, 1)
+addi(a1, s0, C0); addi(a2, s0, C1); addi(a3, s0, C2)
+label('loop')
+emit(amo(0b00000, 8, zero, a1, t0))                  # amoadd.d
+emit(amo(0b00000, 4, zero, a2, t0))                  # amoadd.w
+label('retry')
+emit(amo(0b00010, 8, t1, a3, 0))                     # lr.d
+addi(t1, t1, 1)
+emit(amo(0b00011, 8, t2, a3, t1))                    # sc.d
+branch(1, t2, zero, 'retry')
+addi(s1, s1, -1)
+branch(1, s1, zero, 'loop')
+addi(t1, s0, DONE); emit(amo(0b00000, 8, zero, t1, t0))
+label('spin')
+branch(1, s5, zero, 'spin')                          # only hart 0 goes on
+addi(t2, zero, nr_harts)
+label('wait')
+ld(t1, s0, DONE)
+branch(1, t1, t2, 'wait')
+li(t2, nr_harts * iters)
+ld(a0, s0, C0); xor(a0, a0, t2)
+lwu(t1, s0, C1); xor(t1, t1, t2); or_(a0, a0, t1)
+ld(t1, s0, C2); xor(t1, t1, t2); or_(a0, a0, t1)
+ld(t1, s0, 0); addi(t1, t1, -magic); or_(a0, a0, t1)
+emit(0x0000006b)                                     # nemu_trap
+label('fail')
+emit(i_type(0x73, a0, 2, 0, 0x342))                  # csrr a0, mcause
+addi(a0, a0, 0x100)
+emit(0x0000006b)
+
+for i, f3, rs1, rs2, name in fixups:
+  off = labels[name] - i * 4
+  if f3 == 'addi_label': code[i] = i_type(0x13, rs1, 0, rs2, off + 4)  # after the auipc
+  else: code[i] = b_type(f3, rs1, rs2, off)
+
+img = bytearray(0x3000)
+img[0:len(code) * 4] = struct.pack('<%dI' % len(code), *code)
+struct.pack_into('<Q', img, DATA, magic)
+# root[1]: VA 0x40000000 -> PA 0x80000000, root[2]: identity, both RWX and AD
+struct.pack_into('<QQ', img, ROOT + 8, (0x80000 << 10) | 0xcf, (0x80000 << 10) | 0xcf)
+open(sys.argv[2], 'wb').write(img)
+EOF
+
+out=$(timeout $TIMEOUT $NEMU -b $OUT/amo.bin 2>&1)
+if echo "$out" | grep -q "nemu_trap case 0$\|nemu_trap case 0[^0-9a-f]"; then
+  echo "PASS $NR_HARTS harts"
+  exit 0
+fi
+echo "$out" | grep -a "nemu_trap" || echo "no nemu_trap in $TIMEOUT seconds"
+echo "FAIL $NR_HARTS harts"
+exit 1
@@ -0,0 +1,92 @@
+#!/bin/bash
+#***************************************************************************************
+# Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# Check that reserved ALU encodings with rd = x0 are illegal instructions,
+# and that the valid ones with rd = x0 run as nops.
+#
+# usage: test_reserved_x0.sh [riscv64 NEMU binary]
+#
+# Every encoding is run by its own bare metal image:
+#
+#   mtvec = handler; <encoding>; a0 = 0xbad; nemu_trap
+#   handler: a0 = mcause; nemu_trap
+#
+# so a reserved encoding must end with "nemu_trap case 2" (illegal
+# instruction), or with "invalid opcode" when NEMU is built with
+# CONFIG_REPORT_ILLEGAL_INSTR, and a valid one must end with
+# "nemu_trap case bad".
+
+NEMU_HOME=${NEMU_HOME:-$(cd $(dirname $0)/.. && pwd)}
+NEMU=${1:-$NEMU_HOME/build/riscv64-nemu-interpreter}
+OUT=$(mktemp -d)
+trap "rm -rf $OUT" EXIT
+
+# name encoding expected(illegal|nop)
+CASES="
+op_funct7_1111111   0xfe000033 illegal
+op32_funct7_1111111 0xfe00003b illegal
+slli_funct7_1111111 0xfe001013 illegal
+slliw_imm5          0x0200101b illegal
+srliw_imm5          0x0200501b illegal
+sraiw_funct7_0100001 0x4200501b illegal
+add_x0              0x00208033 nop
+addi_x0             0x00108013 nop
+slliw_x0            0x0010101b nop
+subw_x0             0x4020803b nop
+"
+
+# make_image <encoding> <file>
+make_image() {
+  python3 - $1 $2 <<'EOF'
+import struct, sys
+def i_type(op, rd, f3, rs1, imm): return ((imm & 0xfff) << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op
+def r_type(op, rd, f3, rs1, rs2, f7): return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op
+t0, t1, a0 = 5, 6, 10
+code = [
+  0x00000297,                             # auipc t0, 0
+  i_type(0x13, t0, 0, t0, 7 * 4),         # addi t0, t0, handler
+  i_type(0x73, 0, 1, t0, 0x305),          # csrw mtvec, t0
+  int(sys.argv[1], 16),                   # the encoding under test
+  i_type(0x13, a0, 0, 0, 0x5ad),          # li a0, 0x5ad
+  i_type(0x13, a0, 0, a0, 0x600),         # addi a0, a0, 0x600 (a0 = 0xbad)
+  0x0000006b,                             # nemu_trap
+  i_type(0x73, a0, 2, 0, 0x342),          # handler: csrr a0, mcause
+  0x0000006b,                             # nemu_trap
+]
+open(sys.argv[2], 'wb').write(struct.pack('<%dI' % len(code), *code))
+EOF
+}
+
+fail=0
+while read name enc expected; do
+  [ -z "$name" ] && continue
+  make_image $enc $OUT/$name.bin
+  out=$($NEMU -b $OUT/$name.bin 2>&1)
+  if echo "$out" | grep -q "nemu_trap case bad"; then
+    result=nop
+  elif echo "$out" | grep -q -e "nemu_trap case 2$" -e "nemu_trap case 2[^0-9a-f]" -e "invalid opcode"; then
+    result=illegal
+  else
+    result=unknown
+  fi
+  if [ $result == $expected ]; then
+    echo "PASS $name ($enc): $result"
+  else
+    echo "FAIL $name ($enc): $result, expected $expected"
+    fail=1
+  fi
+done <<< "$CASES"
+exit $fail
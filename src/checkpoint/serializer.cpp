@@ -20,6 +20,7 @@
 #include <checkpoint/cpt_env.h>
 #include <checkpoint/path_manager.h>
 #include <checkpoint/serializer.h>
+#include <checkpoint/sparse_cpt.h>
 #include <profiling/profiling_control.h>
 
 #include "../isa/riscv64/local-include/csr.h"
@@ -29,11 +30,17 @@
 
 #include <cinttypes>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <limits>
 #include <string>
+#include <thread>
+#include <vector>
 #include <zlib.h>
 
 #include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <fstream>
 #include <gcpt_restore/src/restore_rom_addr.h>
 #include <zstd.h>
@@ -45,6 +52,7 @@ using std::fstream;
 using std::numeric_limits;
 using std::string;
 using std::to_string;
+using std::vector;
 
 Serializer::Serializer()
   : IntRegStartAddr(INT_REG_CPT_ADDR - BOOT_CODE),
@@ -63,14 +71,101 @@ uint8_t *guest_to_host(paddr_t paddr);
 extern bool log_enable();
 extern void log_flush();
 extern unsigned long MEMORY_SIZE;
+#ifdef CONFIG_PMEM_DIRTY_TRACK
+void pmem_dirty_mark(paddr_t addr, size_t len);
+bool pmem_dirty_test(paddr_t addr);
+void pmem_dirty_clear();
+#endif
 }
 
+#ifdef CONFIG_CPT_DELTA_CHAIN
+static bool cptPageDirty(uint64_t mem_offset) { return pmem_dirty_test(CONFIG_MBASE + mem_offset); }
+#endif
+
 #ifdef CONFIG_MEM_COMPRESS
+// Guest memory is compressed in chunks by several threads and written to
+// the file chunk by chunk, so the memory needed does not grow with the
+// guest memory.
+static const size_t CptChunkSize = 16 * 1024 * 1024;
+
+static int cptCompressThreads() {
+  int n = cpt_compress_threads > 0 ? cpt_compress_threads : (int)std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+static void writeCptChunk(FILE *fp, const void *buf, size_t len) {
+  if (fwrite(buf, 1, len, fp) != len) {
+    xpanic("Write failed on physical memory checkpoint file: %s\n", strerror(errno));
+  }
+}
+
+static void gzCompressChunk(const uint8_t *src, size_t len, vector<uint8_t> *out) {
+  z_stream strm = {};
+  // 16 + MAX_WBITS writes a gzip header and trailer, the same as gzopen()
+  int ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  assert(ret == Z_OK);
+  out->resize(deflateBound(&strm, len));
+  strm.next_in = (Bytef *)src;
+  strm.avail_in = len;
+  strm.next_out = out->data();
+  strm.avail_out = out->size();
+  ret = deflate(&strm, Z_FINISH);
+  assert(ret == Z_STREAM_END);
+  out->resize(strm.total_out);
+  deflateEnd(&strm);
+}
+
+// Every chunk is compressed into a gzip member, like pigz does. gzread()
+// reads the members one after another as a single stream, so the file is
+// loaded by load_gz_img() as before.
+static void writeGzPMem(FILE *fp, const uint8_t *pmem, size_t size, int nr_thread) {
+  vector<vector<uint8_t>> out(nr_thread);
+  for (size_t base = 0; base < size; base += CptChunkSize * nr_thread) {
+    vector<std::thread> workers;
+    for (int t = 0; t < nr_thread && base + t * CptChunkSize < size; t++) {
+      size_t offset = base + t * CptChunkSize;
+      size_t len = std::min(CptChunkSize, size - offset);
+      workers.emplace_back(gzCompressChunk, pmem + offset, len, &out[t]);
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+      workers[t].join();
+      writeCptChunk(fp, out[t].data(), out[t].size());
+    }
+  }
+}
+
+// zstd compresses the jobs of a single frame with its own worker threads.
+static void writeZstdPMem(FILE *fp, const uint8_t *pmem, size_t size, int nr_thread) {
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  assert(cctx);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 1);
+  if (nr_thread > 1 && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, nr_thread))) {
+    Log("libzstd is built without multithreading, compressing with one thread");
+  }
+  // keep the content size in the frame header, as ZSTD_compress() does
+  ZSTD_CCtx_setPledgedSrcSize(cctx, size);
+
+  vector<uint8_t> out(ZSTD_CStreamOutSize());
+  ZSTD_inBuffer input = {pmem, size, 0};
+  size_t remaining;
+  do {
+    ZSTD_outBuffer output = {out.data(), out.size(), 0};
+    remaining = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+    if (ZSTD_isError(remaining)) {
+      xpanic("zstd compression error: %s\n", ZSTD_getErrorName(remaining));
+    }
+    writeCptChunk(fp, out.data(), output.pos);
+  } while (remaining != 0);
+  ZSTD_freeCCtx(cctx);
+}
+
 void Serializer::serializePMem(uint64_t inst_count) {
   // We must dump registers before memory to store them in the Generic Arch CPT
   assert(regDumped);
   const size_t PMEM_SIZE = MEMORY_SIZE;
   uint8_t *pmem = get_pmem();
+  // fread() below can not fault in the runs of a lazily restored checkpoint
+  IFDEF(CONFIG_CPT_LAZY_RESTORE, sparse_cpt_lazy_fill(pmem, PMEM_SIZE));
 
   assert(restorer);
   FILE *restore_fp = fopen(restorer, "rb");
@@ -92,60 +187,58 @@ void Serializer::serializePMem(uint64_t inst_count) {
     filepath = pathManager.getOutputPath() + "_" + to_string(inst_count);
   }
 
+  int nr_thread = cptCompressThreads();
+  auto start = std::chrono::steady_clock::now();
+  FILE *fp = nullptr;
   if (compress_file_format == GZ_FORMAT) {
     filepath += "_.gz";
-    gzFile compressed_mem = gzopen(filepath.c_str(), "wb");
-    if (compressed_mem == nullptr) {
+    fp = fopen(filepath.c_str(), "wb");
+    if (fp == nullptr) {
       cerr << "Failed to open " << filepath << endl;
       xpanic("Can't open physical memory checkpoint file!\n");
     } else {
       cout << "Opening " << filepath << " as checkpoint output file" << endl;
     }
-
-    uint64_t pass_size = 0;
-
-    for (uint64_t written = 0; written < PMEM_SIZE; written += pass_size) {
-      pass_size = numeric_limits<int>::max() < ((int64_t)PMEM_SIZE - (int64_t)written)
-                    ? numeric_limits<int>::max()
-                    : ((int64_t)PMEM_SIZE - (int64_t)written);
-
-      if (gzwrite(compressed_mem, pmem + written, (uint32_t)pass_size) != (int)pass_size) {
-        xpanic("Write failed on physical memory checkpoint file\n");
-      }
-      Log("Written 0x%lx bytes\n", pass_size);
-    }
-
-    if (gzclose(compressed_mem)) {
-      xpanic("Close failed on physical memory checkpoint file\n");
-    }
+    writeGzPMem(fp, pmem, PMEM_SIZE, nr_thread);
   } else if (compress_file_format == ZSTD_FORMAT) {
     filepath += "_.zstd";
-    // zstd compress
-    size_t const compress_buffer_size = ZSTD_compressBound(PMEM_SIZE);
-    void *const compress_buffer = malloc(compress_buffer_size);
-    assert(compress_buffer);
-
-    size_t const compress_size = ZSTD_compress(compress_buffer, compress_buffer_size, pmem, PMEM_SIZE, 1);
-    assert(compress_size <= compress_buffer_size && compress_size != 0);
-
-    FILE *compress_file = fopen(filepath.c_str(), "wb");
-    size_t fw_size = fwrite(compress_buffer, 1, compress_size, compress_file);
-
-    if (fw_size != (size_t)compress_size) {
-      free(compress_buffer);
-      xpanic("file write error: %s : %s \n", filepath.c_str(), strerror(errno));
+    fp = fopen(filepath.c_str(), "wb");
+    if (fp == nullptr) {
+      xpanic("file open error: %s : %s \n", filepath.c_str(), strerror(errno));
     }
-
-    if (fclose(compress_file)) {
-      free(compress_buffer);
-      xpanic("file close error: %s : %s \n", filepath.c_str(), strerror(errno));
+    writeZstdPMem(fp, pmem, PMEM_SIZE, nr_thread);
+  } else if (compress_file_format == SPARSE_FORMAT) {
+    filepath += "_.sparse";
+    fp = fopen(filepath.c_str(), "wb");
+    if (fp == nullptr) {
+      xpanic("file open error: %s : %s \n", filepath.c_str(), strerror(errno));
     }
-
-    free(compress_buffer);
+    const char *base = nullptr;
+    bool (*page_dirty)(uint64_t) = nullptr;
+#ifdef CONFIG_CPT_DELTA_CHAIN
+    if (!deltaBase.empty()) {
+      base = deltaBase.c_str();
+      page_dirty = cptPageDirty;
+      // the restorer and the registers are not written by paddr_write()
+      pmem_dirty_mark(CONFIG_MBASE, CSR_CPT_ADDR + 4096 * 8 - BOOT_CODE);
+      Log("Dumping a delta of %s", base);
+    }
+#endif
+    // the register block is from BOOT_FLAGS to the end of the CSRs
+    sparse_cpt_dump(fp, pmem, PMEM_SIZE, BOOT_FLAGS - BOOT_CODE, CSR_CPT_ADDR + 4096 * 8 - BOOT_FLAGS,
+        base, page_dirty, nr_thread);
   } else {
     xpanic("You need to specify the compress file format using: --checkpoint-format\n");
   }
 
+  uint64_t compressed_size = ftell(fp);
+  if (fclose(fp)) {
+    xpanic("file close error: %s : %s \n", filepath.c_str(), strerror(errno));
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  Log("Compressed %lu MiB into %lu MiB with %d threads in %lu ms", PMEM_SIZE >> 20,
+      compressed_size >> 20, nr_thread, (uint64_t)elapsed.count());
+
   Log("Checkpoint done!\n");
   regDumped = false;
 }
@@ -228,11 +321,86 @@ void Serializer::serializeRegs() {
 void Serializer::serializeRegs() {}
 #endif
 
+// Reap the dump processes which have finished, and wait for the oldest ones
+// until at most max_in_flight are left.
+void Serializer::waitDumps(size_t max_in_flight) {
+  for (auto it = dumpPids.begin(); it != dumpPids.end();) {
+    bool block = dumpPids.size() > max_in_flight;
+    int status;
+    pid_t ret = waitpid(*it, &status, block ? 0 : WNOHANG);
+    if (ret == 0) {
+      ++it;
+      continue;
+    }
+    if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      xpanic("Checkpoint dump process %d failed\n", *it);
+    }
+    it = dumpPids.erase(it);
+  }
+}
+
+// The forked process has a copy-on-write view of guest memory and the
+// devices, so the registers and memory it dumps are the ones at this point,
+// while the simulation goes on in this process.
+void Serializer::serializeAsync(uint64_t inst_count) {
+  waitDumps(cpt_async_dumps - 1);
+  // the buffered output would be written by both processes
+  fflush(nullptr);
+  // otherwise every forked process would decompress the lazily restored runs again
+  IFDEF(CONFIG_CPT_LAZY_RESTORE, sparse_cpt_lazy_fill(get_pmem(), MEMORY_SIZE));
+  pid_t pid = fork();
+  if (pid < 0) {
+    xpanic("Can't fork to dump checkpoint: %s\n", strerror(errno));
+  }
+  if (pid == 0) {
+    serializeRegs();
+    serializePMem(inst_count);
+    fflush(nullptr);
+    _exit(0);
+  }
+  Log("Dumping checkpoint @ %lu in process %d", inst_count, pid);
+  static bool wait_at_exit = false;
+  if (!wait_at_exit) {
+    // the dumps in flight are finished before NEMU exits
+    atexit([]() { serializer.waitDumps(0); });
+    wait_at_exit = true;
+  }
+  dumpPids.push_back(pid);
+}
+
+// A uniform checkpoint is a delta of the previous one, unless it is the
+// first one or there are already cpt_delta_chain deltas after the last full
+// one.
+void Serializer::chooseDeltaBase(uint64_t inst_count) {
+  deltaBase.clear();
+  if (cpt_delta_chain <= 0 ||
+      (checkpoint_state != UniformCheckpointing && checkpoint_state != ManualUniformCheckpointing)) {
+    return;
+  }
+  if (!prevCptPath.empty() && deltaChainLen < cpt_delta_chain) {
+    deltaBase = fs::relative(prevCptPath, pathManager.getOutputPath()).string();
+    deltaChainLen++;
+  } else {
+    deltaChainLen = 0;
+  }
+  // the same path as in serializePMem()
+  prevCptPath = pathManager.getOutputPath() + "_" + to_string(inst_count) + "_.sparse";
+}
+
 void Serializer::serialize(uint64_t inst_count) {
 
 #ifdef CONFIG_MEM_COMPRESS
-  serializeRegs();
-  serializePMem(inst_count);
+  chooseDeltaBase(inst_count);
+  if (cpt_async_dumps > 0) {
+    serializeAsync(inst_count);
+  } else {
+    serializeRegs();
+    serializePMem(inst_count);
+  }
+  // the next delta has the pages written from now on
+#ifdef CONFIG_CPT_DELTA_CHAIN
+  if (cpt_delta_chain > 0) pmem_dirty_clear();
+#endif
 #else
   xpanic("You should enable CONFIG_MEM_COMPRESS in menuconfig");
 #endif
@@ -265,6 +433,9 @@ void Serializer::init() {
     intervalSize = checkpoint_interval;
     Log("Taking uniform checkpionts with interval %lu", checkpoint_interval);
     nextUniformPoint = intervalSize;
+    if (cpt_delta_chain > 0 && compress_file_format != SPARSE_FORMAT) {
+      xpanic("Delta checkpoints need --checkpoint-format sparse\n");
+    }
   }
   pathManager.setCheckpointingOutputDir();
 }
@@ -275,7 +446,7 @@ bool Serializer::instrsCouldTakeCpt(uint64_t num_insts) {
       if (simpoint2Weights.empty()) {
         break;
       } else {
-        uint64_t next_point = simpoint2Weights.begin()->first * intervalSize + 100000;
+        uint64_t next_point = nextCptPoint();
         if (num_insts >= next_point) {
           Log("Should take cpt now: %lu", num_insts);
           return true;
@@ -303,6 +474,24 @@ bool Serializer::instrsCouldTakeCpt(uint64_t num_insts) {
   return false;
 }
 
+// the instruction count at which the next checkpoint could be taken
+uint64_t Serializer::nextCptPoint() {
+  switch (checkpoint_state) {
+    case SimpointCheckpointing:
+      if (simpoint2Weights.empty()) {
+        return UINT64_MAX;
+      }
+      return simpoint2Weights.begin()->first * intervalSize + 100000;
+    case ManualOneShotCheckpointing:
+      return 0;
+    case ManualUniformCheckpointing:
+    case UniformCheckpointing:
+      return nextUniformPoint;
+    default:
+      return UINT64_MAX;
+  }
+}
+
 void Serializer::notify_taken(uint64_t i) {
   Log("Taking checkpoint @ instruction count %lu", i);
   if (checkpoint_state == SimpointCheckpointing) {
@@ -351,6 +540,10 @@ bool try_take_cpt(uint64_t icount) {
   return false;
 }
 
+uint64_t next_cpt_point() {
+  return serializer.nextCptPoint();
+}
+
 void serialize_reg_to_mem() {
   serializer.serializeRegs();
 }
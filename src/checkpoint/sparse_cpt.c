@@ -0,0 +1,416 @@
+/***************************************************************************************
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE       // for mremap()
+#endif
+#include <common.h>
+#include <checkpoint/sparse_cpt.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+bool is_sparse_cpt_file(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  char magic[8];
+  bool ret = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+    memcmp(magic, SPARSE_CPT_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  return ret;
+}
+
+#ifdef CONFIG_MEM_COMPRESS
+#include <errno.h>
+#include <memory/paddr.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <zstd.h>
+
+#define RUN_MAX_SIZE (SPARSE_CPT_MAX_RUN * SPARSE_CPT_PAGE_SIZE)
+
+static int resolve_nr_thread(int nr_thread) {
+  if (nr_thread <= 0) nr_thread = sysconf(_SC_NPROCESSORS_ONLN);
+  return nr_thread > 0 ? nr_thread : 1;
+}
+
+static bool page_is_zero(const uint8_t *page) {
+  const uint64_t *p = (const uint64_t *)page;
+  for (int i = 0; i < SPARSE_CPT_PAGE_SIZE / sizeof(uint64_t); i ++) {
+    if (p[i] != 0) return false;
+  }
+  return true;
+}
+
+// The runs are handed out to the threads by an atomic counter.
+typedef struct {
+  SparseCptRun *runs;
+  uint64_t nr_runs;
+  uint64_t next;
+  uint8_t *mem;
+  // dump
+  uint8_t **bufs;
+  // load
+  int fd;
+  bool failed;
+} RunTasks;
+
+static void run_threads(void *(*worker)(void *), RunTasks *tasks, int nr_thread) {
+  pthread_t threads[nr_thread];
+  for (int i = 1; i < nr_thread; i ++) {
+    int ret = pthread_create(&threads[i], NULL, worker, tasks);
+    Assert(ret == 0, "Can not create the thread for the sparse checkpoint");
+  }
+  worker(tasks);
+  for (int i = 1; i < nr_thread; i ++) pthread_join(threads[i], NULL);
+}
+
+static void *compress_worker(void *arg) {
+  RunTasks *t = arg;
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  uint64_t i;
+  while ((i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED)) < t->nr_runs) {
+    SparseCptRun *r = &t->runs[i];
+    size_t len = r->nr_pages << SPARSE_CPT_PAGE_SHIFT;
+    size_t ret = ZSTD_compressCCtx(cctx, t->bufs[i], ZSTD_compressBound(RUN_MAX_SIZE),
+        t->mem + r->mem_offset, len, 1);
+    Assert(!ZSTD_isError(ret), "zstd compression error: %s", ZSTD_getErrorName(ret));
+    r->file_size = ret;
+  }
+  ZSTD_freeCCtx(cctx);
+  return NULL;
+}
+
+static void write_or_panic(FILE *fp, const void *buf, size_t len) {
+  if (fwrite(buf, 1, len, fp) != len) {
+    xpanic("Write failed on sparse checkpoint: %s\n", strerror(errno));
+  }
+}
+
+// The runs are found and compressed in batches, so the memory used does not
+// grow with the guest memory.
+void sparse_cpt_dump(FILE *fp, const uint8_t *mem, uint64_t size,
+    uint64_t regs_mem_offset, uint64_t regs_size,
+    const char *base, bool (*page_dirty)(uint64_t mem_offset), int nr_thread) {
+  nr_thread = resolve_nr_thread(nr_thread);
+  SparseCptHeader h = {};
+  memcpy(h.magic, SPARSE_CPT_MAGIC, sizeof(h.magic));
+  h.version = SPARSE_CPT_VERSION;
+  h.page_shift = SPARSE_CPT_PAGE_SHIFT;
+  h.mem_size = size;
+  h.regs_mem_offset = regs_mem_offset;
+  h.regs_offset = sizeof(h);
+  h.regs_size = regs_size;
+  write_or_panic(fp, &h, sizeof(h));
+  write_or_panic(fp, mem + regs_mem_offset, regs_size);
+  uint64_t file_offset = h.regs_offset + regs_size;
+  if (base != NULL) {
+    h.base_offset = file_offset;
+    h.base_size = strlen(base);
+    write_or_panic(fp, base, h.base_size);
+    file_offset += h.base_size;
+  }
+#define IN_CPT(page) (base != NULL ? page_dirty((page) << SPARSE_CPT_PAGE_SHIFT) : \
+    !page_is_zero(mem + ((page) << SPARSE_CPT_PAGE_SHIFT)))
+
+  const int batch = nr_thread * 4;
+  uint8_t *bufs[batch];
+  for (int i = 0; i < batch; i ++) {
+    bufs[i] = malloc(ZSTD_compressBound(RUN_MAX_SIZE));
+    Assert(bufs[i] != NULL, "Can not allocate the buffer for the sparse checkpoint");
+  }
+  SparseCptRun *index = NULL;
+  uint64_t nr_index = 0, index_cap = 0;
+
+  uint64_t nr_pages = size >> SPARSE_CPT_PAGE_SHIFT;
+  uint64_t page = 0;
+  while (page < nr_pages) {
+    // find the next batch of runs
+    SparseCptRun runs[batch];
+    int n = 0;
+    while (n < batch && page < nr_pages) {
+      if (!IN_CPT(page)) { page ++; continue; }
+      SparseCptRun *r = &runs[n ++];
+      r->mem_offset = page << SPARSE_CPT_PAGE_SHIFT;
+      r->nr_pages = 0;
+      while (page < nr_pages && r->nr_pages < SPARSE_CPT_MAX_RUN && IN_CPT(page)) {
+        r->nr_pages ++;
+        page ++;
+      }
+    }
+
+    RunTasks tasks = { .runs = runs, .nr_runs = n, .mem = (uint8_t *)mem, .bufs = bufs };
+    run_threads(compress_worker, &tasks, nr_thread < n ? nr_thread : n);
+
+    if (nr_index + n > index_cap) {
+      index_cap = (index_cap == 0 ? 1024 : index_cap * 2);
+      index = realloc(index, index_cap * sizeof(index[0]));
+      Assert(index != NULL, "Can not allocate the index of the sparse checkpoint");
+    }
+    for (int i = 0; i < n; i ++) {
+      write_or_panic(fp, bufs[i], runs[i].file_size);
+      runs[i].file_offset = file_offset;
+      file_offset += runs[i].file_size;
+      index[nr_index ++] = runs[i];
+    }
+  }
+
+  h.nr_runs = nr_index;
+  h.index_offset = file_offset;
+  write_or_panic(fp, index, nr_index * sizeof(index[0]));
+  fseek(fp, 0, SEEK_SET);
+  write_or_panic(fp, &h, sizeof(h));
+  fseek(fp, 0, SEEK_END);
+
+  uint64_t nr_dumped = 0;
+  for (uint64_t i = 0; i < nr_index; i ++) nr_dumped += index[i].nr_pages;
+  Log("Sparse checkpoint: %lu of %lu %s pages are dumped in %lu runs",
+      nr_dumped, nr_pages, (base != NULL ? "dirty" : "non-zero"), nr_index);
+  free(index);
+  for (int i = 0; i < batch; i ++) free(bufs[i]);
+#undef IN_CPT
+}
+
+static void *decompress_worker(void *arg) {
+  RunTasks *t = arg;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  uint8_t *buf = malloc(ZSTD_compressBound(RUN_MAX_SIZE));
+  uint64_t i;
+  while ((i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED)) < t->nr_runs) {
+    SparseCptRun *r = &t->runs[i];
+    size_t len = r->nr_pages << SPARSE_CPT_PAGE_SHIFT;
+    if (r->file_size > ZSTD_compressBound(RUN_MAX_SIZE) ||
+        pread(t->fd, buf, r->file_size, r->file_offset) != r->file_size ||
+        ZSTD_decompressDCtx(dctx, t->mem + r->mem_offset, len, buf, r->file_size) != len) {
+      t->failed = true;
+      break;
+    }
+  }
+  free(buf);
+  ZSTD_freeDCtx(dctx);
+  return NULL;
+}
+
+// Set the memory between the runs to zero. The host pages are dropped
+// instead of written if possible, so they are not allocated.
+static void zero_mem(uint8_t *start, uint8_t *end) {
+  if (start >= end) return;
+  if (madvise(start, end - start, MADV_DONTNEED) != 0) memset(start, 0, end - start);
+}
+
+// Read and check the header and the run index.
+static SparseCptRun *read_index(const char *filename, int fd, SparseCptHeader *h, uint64_t size) {
+  Assert(pread(fd, h, sizeof(*h), 0) == sizeof(*h) &&
+      memcmp(h->magic, SPARSE_CPT_MAGIC, sizeof(h->magic)) == 0, "'%s' is not a sparse checkpoint", filename);
+  Assert(h->version >= 1 && h->version <= SPARSE_CPT_VERSION && h->page_shift == SPARSE_CPT_PAGE_SHIFT,
+      "Unsupported sparse checkpoint version %u, page shift %u", h->version, h->page_shift);
+  if (h->version == 1) {
+    // no delta in version 1, and its header is shorter
+    h->base_offset = h->base_size = 0;
+  }
+  Assert(h->mem_size <= size, "The checkpoint has %lu bytes of memory, larger than %lu", h->mem_size, size);
+
+  SparseCptRun *runs = malloc(h->nr_runs * sizeof(runs[0]) + 1);
+  Assert(runs != NULL, "Can not allocate the index of the sparse checkpoint");
+  ssize_t index_size = h->nr_runs * sizeof(runs[0]);
+  Assert(pread(fd, runs, index_size, h->index_offset) == index_size, "Can not read the index of '%s'", filename);
+
+  uint64_t last_end = 0;
+  for (uint64_t i = 0; i < h->nr_runs; i ++) {
+    Assert(runs[i].mem_offset >= last_end && runs[i].mem_offset % SPARSE_CPT_PAGE_SIZE == 0 &&
+        runs[i].nr_pages <= SPARSE_CPT_MAX_RUN &&
+        runs[i].mem_offset + (runs[i].nr_pages << SPARSE_CPT_PAGE_SHIFT) <= h->mem_size,
+        "Bad run %lu in '%s'", i, filename);
+    last_end = runs[i].mem_offset + (runs[i].nr_pages << SPARSE_CPT_PAGE_SHIFT);
+  }
+  return runs;
+}
+
+#ifdef CONFIG_CPT_LAZY_RESTORE
+// Lazy restore. All guest memory in the checkpoint is dropped, and the
+// pages in the runs are made inaccessible. The first access to a run
+// faults, and the SIGSEGV handler decompresses the run and makes it
+// accessible, so only the runs touched by the guest (or by NEMU) are ever
+// decompressed. The host kernel can not fault in the runs, e.g. by
+// read(2), so sparse_cpt_lazy_fill() should be called before that.
+//
+// Several threads may fault on the same run, so the runs are loaded under
+// lazy.lock. A run is decompressed into a staging mapping, which is then
+// moved over the run by mremap(), so other threads never see a run that is
+// accessible but only partly decompressed.
+
+static struct {
+  uint8_t *mem;
+  uint64_t mem_size;
+  SparseCptRun *runs;
+  uint64_t nr_runs;
+  uint64_t nr_loaded;
+  uint8_t *loaded;        // loaded[i]: run i is decompressed
+  int fd;
+  ZSTD_DCtx *dctx;
+  uint8_t *buf;
+  pthread_mutex_t lock;   // for all the above
+  struct sigaction old_action;
+} lazy = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void lazy_load_run(uint64_t i) {
+  pthread_mutex_lock(&lazy.lock);
+  if (lazy.loaded[i]) {
+    // loaded by another thread
+    pthread_mutex_unlock(&lazy.lock);
+    return;
+  }
+  SparseCptRun *r = &lazy.runs[i];
+  uint8_t *start = lazy.mem + r->mem_offset;
+  size_t len = r->nr_pages << SPARSE_CPT_PAGE_SHIFT;
+  uint8_t *stage = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  Assert(stage != MAP_FAILED, "Can not allocate the staging pages for run %lu: %s", i, strerror(errno));
+  pmem_apply_policy(stage, len);
+  Assert(r->file_size <= ZSTD_compressBound(RUN_MAX_SIZE) &&
+      pread(lazy.fd, lazy.buf, r->file_size, r->file_offset) == r->file_size &&
+      ZSTD_decompressDCtx(lazy.dctx, stage, len, lazy.buf, r->file_size) == len,
+      "Can not decompress run %lu of the sparse checkpoint", i);
+  if (mremap(stage, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, start) == MAP_FAILED) {
+    // too many mappings, copy the run instead, other threads may see it
+    // partly copied then
+    Assert(mprotect(start, len, PROT_READ | PROT_WRITE) == 0,
+        "Can not make run %lu accessible: %s", i, strerror(errno));
+    memcpy(start, stage, len);
+    munmap(stage, len);
+  }
+  lazy.loaded[i] = 1;
+  lazy.nr_loaded ++;
+  pthread_mutex_unlock(&lazy.lock);
+}
+
+// the run containing the offset, or -1
+static int64_t lazy_find_run(uint64_t offset) {
+  uint64_t l = 0, r = lazy.nr_runs;
+  while (l < r) {
+    uint64_t m = (l + r) / 2;
+    if (lazy.runs[m].mem_offset <= offset) l = m + 1;
+    else r = m;
+  }
+  if (l == 0) return -1;
+  SparseCptRun *run = &lazy.runs[l - 1];
+  return offset < run->mem_offset + (run->nr_pages << SPARSE_CPT_PAGE_SHIFT) ? l - 1 : -1;
+}
+
+static void lazy_segv_handler(int sig, siginfo_t *info, void *ucontext) {
+  uint8_t *addr = info->si_addr;
+  int64_t i = (addr >= lazy.mem && addr < lazy.mem + lazy.mem_size ? lazy_find_run(addr - lazy.mem) : -1);
+  if (i < 0) {
+    // not an access to a run, let the old handler do it
+    sigaction(SIGSEGV, &lazy.old_action, NULL);
+    return;
+  }
+  // a run loaded by another thread since the fault is accessed again
+  lazy_load_run(i);
+}
+
+void sparse_cpt_lazy_fill(uint8_t *start, uint64_t len) {
+  if (lazy.runs == NULL || start + len <= lazy.mem || start >= lazy.mem + lazy.mem_size) return;
+  uint64_t begin = (start > lazy.mem ? start - lazy.mem : 0);
+  uint64_t end = start + len - lazy.mem;
+  int64_t first = lazy_find_run(begin);
+  for (uint64_t i = (first >= 0 ? first : 0); i < lazy.nr_runs && lazy.runs[i].mem_offset < end; i ++) {
+    uint64_t run_end = lazy.runs[i].mem_offset + (lazy.runs[i].nr_pages << SPARSE_CPT_PAGE_SHIFT);
+    if (run_end > begin) lazy_load_run(i);
+  }
+}
+
+static long sparse_cpt_load_lazy(const char *filename, int fd, SparseCptHeader *h,
+    SparseCptRun *runs, uint8_t *mem) {
+  extern int pmem_hugepage;
+  Assert(pmem_hugepage != PMEM_HUGEPAGE_HUGETLB,
+      "Lazy restore to guest memory backed by hugetlbfs is not supported");
+  Assert(lazy.runs == NULL, "Only one sparse checkpoint can be restored lazily");
+  lazy.mem = mem;
+  lazy.mem_size = h->mem_size;
+  lazy.runs = runs;
+  lazy.nr_runs = h->nr_runs;
+  lazy.loaded = calloc(h->nr_runs + 1, sizeof(lazy.loaded[0]));
+  lazy.fd = fd;
+  lazy.dctx = ZSTD_createDCtx();
+  lazy.buf = malloc(ZSTD_compressBound(RUN_MAX_SIZE));
+  Assert(lazy.loaded != NULL && lazy.dctx != NULL && lazy.buf != NULL,
+      "Can not allocate the buffers for lazy restore");
+
+  struct sigaction action = {};
+  action.sa_sigaction = lazy_segv_handler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  int ret = sigaction(SIGSEGV, &action, &lazy.old_action);
+  Assert(ret == 0, "Can not install the SIGSEGV handler for lazy restore");
+
+  zero_mem(mem, mem + h->mem_size);
+  for (uint64_t i = 0; i < h->nr_runs; i ++) {
+    // too many mappings may fail the mprotect(), load the run now then
+    if (mprotect(mem + runs[i].mem_offset, runs[i].nr_pages << SPARSE_CPT_PAGE_SHIFT, PROT_NONE) != 0) {
+      lazy_load_run(i);
+    }
+  }
+  Log("Restoring %lu runs of %s lazily", h->nr_runs, filename);
+  return h->mem_size;
+}
+#endif
+
+long sparse_cpt_load(const char *filename, uint8_t *mem, uint64_t size, int nr_thread) {
+  int fd = open(filename, O_RDONLY);
+  Assert(fd >= 0, "Can not open '%s'", filename);
+  SparseCptHeader h;
+  SparseCptRun *runs = read_index(filename, fd, &h, size);
+  if (h.base_size == 0) {
+#ifdef CONFIG_CPT_LAZY_RESTORE
+    return sparse_cpt_load_lazy(filename, fd, &h, runs, mem);
+#endif
+    uint64_t last_end = 0;
+    for (uint64_t i = 0; i < h.nr_runs; i ++) {
+      zero_mem(mem + last_end, mem + runs[i].mem_offset);
+      last_end = runs[i].mem_offset + (runs[i].nr_pages << SPARSE_CPT_PAGE_SHIFT);
+    }
+    zero_mem(mem + last_end, mem + h.mem_size);
+  } else {
+    // restore the base, then write the pages in the delta over it
+    const char *slash = strrchr(filename, '/');
+    size_t dir_len = (slash != NULL ? slash - filename + 1 : 0);
+    char *base = malloc(dir_len + h.base_size + 1);
+    Assert(base != NULL, "Can not allocate the base path of '%s'", filename);
+    memcpy(base, filename, dir_len);
+    Assert(pread(fd, base + dir_len, h.base_size, h.base_offset) == h.base_size,
+        "Can not read the base path of '%s'", filename);
+    base[dir_len + h.base_size] = '\0';
+    Log("Restoring the base %s of delta checkpoint %s", base, filename);
+    long base_mem_size = sparse_cpt_load(base, mem, size, nr_thread);
+    Assert(base_mem_size == h.mem_size, "The base %s has %lu bytes of memory, but the delta has %lu",
+        base, base_mem_size, h.mem_size);
+    free(base);
+    // the pages of a lazily restored base can only be faulted in by one thread
+    IFDEF(CONFIG_CPT_LAZY_RESTORE, nr_thread = 1);
+  }
+
+  nr_thread = resolve_nr_thread(nr_thread);
+  RunTasks tasks = { .runs = runs, .nr_runs = h.nr_runs, .mem = mem, .fd = fd };
+  run_threads(decompress_worker, &tasks, nr_thread);
+  Assert(!tasks.failed, "Can not decompress '%s'", filename);
+
+  free(runs);
+  close(fd);
+  return h.mem_size;
+}
+
+#endif
@@ -19,8 +19,10 @@
 #include <cpu/exec.h>
 #include <cpu/difftest.h>
 #include <cpu/decode.h>
+#include <cpu/jit.h>
 #include <memory/host-tlb.h>
 #include <isa-all-instr.h>
+#include <limits.h>
 #include <locale.h>
 #include <setjmp.h>
 #include <unistd.h>
@@ -39,12 +41,12 @@
 #define BATCH_SIZE 1
 #endif
 
-CPU_state cpu = {};
-uint64_t g_nr_guest_instr = 0;
+HART_LOCAL CPU_state cpu = {};
+HART_LOCAL uint64_t g_nr_guest_instr = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 const rtlreg_t rzero = 0;
-rtlreg_t tmp_reg[4];
+HART_LOCAL rtlreg_t tmp_reg[4];
 
 #ifdef CONFIG_DEBUG
 static inline void debug_hook(vaddr_t pc, const char *asmbuf) {
@@ -58,32 +60,36 @@ static inline void debug_hook(vaddr_t pc, const char *asmbuf) {
 }
 #endif
 
-static jmp_buf jbuf_exec = {};
-static uint64_t n_remain_total;
-static int n_remain;
-static Decode *prev_s;
+static HART_LOCAL jmp_buf jbuf_exec = {};
+// Instructions are counted per basic block. execute() subtracts the length
+// of a basic block from the remaining count of the batch when leaving it, and
+// saves the remaining count in n_remain. An exception in the middle of a basic
+// block is counted from idx_in_bb of the faulting instruction in cpu_exec().
+static HART_LOCAL uint64_t n_remain_total;
+static HART_LOCAL int n_remain;
+static HART_LOCAL int n_batch; // the number of instructions of the running batch
+static HART_LOCAL Decode *prev_s;
 
 void save_globals(Decode *s) { IFDEF(CONFIG_PERF_OPT, prev_s = s); }
 
+static inline int next_batch() {
+  return n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total;
+}
+
 uint64_t get_abs_instr_count() {
 #if defined(CONFIG_ENABLE_INSTR_CNT)
-  int n_batch = n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total;
-  uint32_t n_executed = n_batch - n_remain;
-  return n_executed + g_nr_guest_instr;
+  return g_nr_guest_instr + (uint32_t)(n_batch - n_remain);
 #endif
   return 0;
 }
 
 static void update_instr_cnt() {
 #if defined(CONFIG_ENABLE_INSTR_CNT)
-  int n_batch = n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total;
   uint32_t n_executed = n_batch - n_remain;
   n_remain_total -= (n_remain_total > n_executed) ? n_executed : n_remain_total;
   IFNDEF(CONFIG_DEBUG, g_nr_guest_instr += n_executed);
 
-  n_remain =
-      n_batch > n_remain_total ? n_remain_total : n_batch; // clean n_remain
-  // Loge("n_remain = %i, n_remain_total = %lu\n", n_remain, n_remain_total);
+  n_batch = n_remain = next_batch(); // clean n_remain
 #endif
 }
 
@@ -92,6 +98,7 @@ void monitor_statistic() {
   setlocale(LC_NUMERIC, "");
   Log("host time spent = %'ld us", g_timer);
 #ifdef CONFIG_ENABLE_INSTR_CNT
+  IFDEF(CONFIG_MULTI_HART, harts_statistic());
   Log("total guest instructions = %'ld", g_nr_guest_instr);
   if (g_timer > 0)
     Log("simulation frequency = %'ld instr/s",
@@ -101,11 +108,17 @@ void monitor_statistic() {
         "frequency");
 #else
   Log("CONFIG_ENABLE_INSTR_CNT is not defined");
+#endif
+  IFDEF(CONFIG_MODE_SYSTEM, isa_mmu_statistic());
+#ifdef CONFIG_PERF_OPT
+  extern void tcache_statistic();
+  tcache_statistic();
+  IFDEF(CONFIG_ENGINE_JIT, jit_statistic());
 #endif
 }
 
-static word_t g_ex_cause = 0;
-static int g_sys_state_flag = 0;
+static HART_LOCAL word_t g_ex_cause = 0;
+static HART_LOCAL int g_sys_state_flag = 0;
 
 void set_sys_state_flag(int flag) { g_sys_state_flag |= flag; }
 
@@ -136,6 +149,8 @@ static bool manual_cpt_quit = false;
 #define rtl_j(s, target)                                                       \
   do {                                                                         \
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n -= s->idx_in_bb);                         \
+    if (s->ras_hint == RAS_HINT_PUSH) ras_push(s);                             \
+    IFDEF(CONFIG_TCACHE_TRACE, s->br_cnt[1]++);                                \
     s = s->tnext;                                                              \
     is_ctrl = true;                                                            \
     br_taken = true;                                                           \
@@ -144,6 +159,7 @@ static bool manual_cpt_quit = false;
 #define rtl_jr(s, target)                                                      \
   do {                                                                         \
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n -= s->idx_in_bb);                         \
+    if (s->ras_hint == RAS_HINT_PUSH) ras_push(s);                             \
     s = jr_fetch(s, *(target));                                                \
     is_ctrl = true;                                                            \
     br_taken = true;                                                           \
@@ -154,10 +170,13 @@ static bool manual_cpt_quit = false;
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n -= s->idx_in_bb);                         \
     is_ctrl = true;                                                            \
     if (interpret_relop(relop, *src1, *src2)) {                                \
+      IFDEF(CONFIG_TCACHE_TRACE, s->br_cnt[1]++);                              \
       s = s->tnext;                                                            \
       br_taken = true;                                                         \
-    } else                                                                     \
+    } else {                                                                   \
+      IFDEF(CONFIG_TCACHE_TRACE, s->br_cnt[0]++);                              \
       s = s->ntnext;                                                           \
+    }                                                                          \
     goto end_of_bb;                                                            \
   } while (0)
 
@@ -183,18 +202,46 @@ static bool manual_cpt_quit = false;
     goto end_of_loop;                                                          \
   } while (0)
 
-static const void **g_exec_table;
+static HART_LOCAL const void **g_exec_table;
 
 Decode *tcache_jr_fetch(Decode *s, vaddr_t jpc);
+Decode *tcache_ras_fetch(Decode *call);
 Decode *tcache_decode(Decode *s);
 void tcache_handle_exception(vaddr_t jpc);
 Decode *tcache_handle_flush(vaddr_t snpc);
+IFDEF(CONFIG_TCACHE_TRACE, Decode *tcache_trace(Decode *src, Decode *next));
+
+// return address stack with the call sites, the return address of a direct
+// call is the snpc of the call, and the basic block there is cached in ntnext
+#define RAS_SIZE 16
+static HART_LOCAL Decode *ras[RAS_SIZE] = {};
+static HART_LOCAL uint32_t ras_top = 0;
+HART_LOCAL uint64_t jr_ras_hit = 0, jr_mru_hit = 0; // read by tcache_statistic()
+
+// the call sites may be evicted by tcache
+void ras_flush() { memset(ras, 0, sizeof(ras)); }
+
+static inline void ras_push(Decode *s) { ras[++ras_top % RAS_SIZE] = s; }
+static inline Decode *ras_pop() { return ras[ras_top-- % RAS_SIZE]; }
 
 static inline Decode *jr_fetch(Decode *s, vaddr_t target) {
-  if (likely(s->tnext->pc == target))
+  if (s->ras_hint == RAS_HINT_POP) {
+    Decode *call = ras_pop();
+    if (likely(call != NULL && call->snpc == target &&
+               call->type == INSTR_TYPE_J)) {
+      jr_ras_hit++;
+      return (likely(call->ntnext != NULL) ? call->ntnext
+                                           : tcache_ras_fetch(call));
+    }
+  }
+  if (likely(s->tnext->pc == target)) {
+    jr_mru_hit++;
     return s->tnext;
-  if (likely(s->ntnext->pc == target))
+  }
+  if (likely(s->ntnext->pc == target)) {
+    jr_mru_hit++;
     return s->ntnext;
+  }
   return tcache_jr_fetch(s, target);
 }
 
@@ -207,6 +254,47 @@ static inline void debug_difftest(Decode *_this, Decode *next) {
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, next->pc));
 }
 
+// per_bb_profile() has nothing to do until the absolute instruction count
+// reaches the next interesting point, e.g. the next checkpoint. execute()
+// calls it only when n drops to n_wake, so a basic block ends with a single
+// compare without profiling and checkpointing.
+static HART_LOCAL int n_wake = INT_MIN;
+
+void update_per_bb_hook() {
+  uint64_t wake = UINT64_MAX;
+  if (workload_loaded || donot_skip_boot) {
+    if (profiling_state == SimpointProfiling) {
+      wake = 0;
+    } else {
+      extern uint64_t next_cpt_point();
+      switch (checkpoint_state) {
+      case ManualOneShotCheckpointing:
+        if (recvd_manual_oneshot_cpt && !manual_cpt_quit) wake = 0;
+        break;
+      case ManualUniformCheckpointing:
+        if (!recvd_manual_uniform_cpt) break;
+        // fall through
+      case UniformCheckpointing:
+      case SimpointCheckpointing:
+        wake = next_cpt_point();
+        break;
+      }
+    }
+  }
+
+#ifdef CONFIG_ENABLE_INSTR_CNT
+  // get_abs_instr_count() >= wake <=> n <= g_nr_guest_instr + n_batch - wake
+  uint64_t batch_end = g_nr_guest_instr + (uint32_t)n_batch;
+  if (wake > batch_end) {
+    n_wake = (wake - batch_end >= INT_MAX) ? INT_MIN : -(int)(wake - batch_end);
+  } else {
+    n_wake = (batch_end - wake >= INT_MAX) ? INT_MAX : (int)(batch_end - wake);
+  }
+#else
+  n_wake = (wake == 0) ? INT_MAX : INT_MIN;
+#endif
+}
+
 #ifndef CONFIG_SHARE
 uint64_t per_bb_profile(Decode *prev_s, Decode *s, bool control_taken) {
   uint64_t abs_inst_count = get_abs_instr_count();
@@ -265,6 +353,7 @@ uint64_t per_bb_profile(Decode *prev_s, Decode *s, bool control_taken) {
       nemu_state.state = NEMU_QUIT;
       manual_cpt_quit = true;
     }
+    update_per_bb_hook();
   }
   return abs_inst_count;
 }
@@ -274,18 +363,19 @@ static int execute(int n) {
   Logtb("Will execute %i instrs\n", n);
   static const void *local_exec_table[TOTAL_INSTR] = {
       MAP(INSTR_LIST, FILL_EXEC_TABLE)};
-  static int init_flag = 0;
+  static HART_LOCAL int init_flag = 0;
   Decode *s = prev_s;
 
   if (likely(init_flag == 0)) {
     g_exec_table = local_exec_table;
+    IFDEF(CONFIG_ENGINE_JIT, jit_init(local_exec_table, &&exec_jit));
     extern Decode *tcache_init(const void *exec_nemu_decode,
+                               const void *exec_tcache_link,
                                vaddr_t reset_vector);
-    s = tcache_init(&&exec_nemu_decode, cpu.pc);
+    s = tcache_init(&&exec_nemu_decode, &&exec_tcache_link, cpu.pc);
     IFDEF(CONFIG_MODE_SYSTEM, hosttlb_init());
     init_flag = 1;
   }
-
   __attribute__((unused)) Decode *this_s = NULL;
   __attribute__((unused)) bool br_taken = false;
   __attribute__((unused)) bool is_ctrl = false;
@@ -309,15 +399,50 @@ static int execute(int n) {
 
     def_EHelper(nemu_decode) {
       s = tcache_decode(s);
+      save_globals(s);
+      continue;
+    }
+
+    // continue with the next basic block when tcache splits a basic block
+    // at the end of a chunk or a page, this is not a guest instruction
+    def_EHelper(tcache_link) {
+      IFDEF(CONFIG_ENABLE_INSTR_CNT, n -= s->idx_in_bb);
+      IFDEF(CONFIG_ENABLE_INSTR_CNT, n_remain = n);
+      s = s->tnext;
+      save_globals(s);
       continue;
     }
 
+#ifdef CONFIG_ENGINE_JIT
+    // run the host code of the instructions translated by the JIT,
+    // which returns the next instruction to interpret
+    def_EHelper(jit) {
+      s = ((Decode *(*)())s->jit_code)();
+      save_globals(s);
+      continue;
+    }
+#endif
+
   end_of_bb:
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n_remain = n);
     IFNDEF(CONFIG_ENABLE_INSTR_CNT, n--);
 
+#ifdef CONFIG_TCACHE_TRACE
+    // The hot successor in a superblock is the next entry, which
+    // needs none of the per basic block actions below.
+    if (s == prev_s + 1 && likely(n > 0) && likely(n > n_wake)) {
+      is_ctrl = false;
+      save_globals(s);
+      continue;
+    }
+    if (br_taken && s->pc <= prev_s->pc && prev_s->type != INSTR_TYPE_I &&
+        unlikely(prev_s->br_cnt[1] >= CONFIG_TCACHE_TRACE_THRESHOLD)) {
+      s = tcache_trace(prev_s, s);
+    }
+#endif
+
     // Here is per bb action
-    if (is_ctrl) {
+    if (is_ctrl && unlikely(n <= n_wake)) {
       uint64_t abs_inst_count = per_bb_profile(prev_s, s, br_taken);
       Logtb("prev pc = 0x%lx, pc = 0x%lx", prev_s->pc, s->pc);
       Logtb("Executed %ld instructions in total, pc: 0x%lx\n",
@@ -351,7 +476,7 @@ end_of_loop:
   Loge(
       "end_of_loop: prev pc = 0x%lx, pc = 0x%lx, total insts: %lu, remain: %lu",
       prev_s->pc, s->pc, get_abs_instr_count(), n_remain_total);
-  if (is_ctrl) {
+  if (is_ctrl && n <= n_wake) {
     per_bb_profile(prev_s, s, br_taken); // TODO: this should be true for mret
   }
 
@@ -360,6 +485,9 @@ end_of_loop:
   return n;
 }
 #else
+// profiling and checkpointing are checked after every instruction
+void update_per_bb_hook() {}
+
 #define FILL_EXEC_TABLE(name) [concat(EXEC_ID_, name)] = concat(exec_, name),
 
 #define rtl_priv_next(s)
@@ -378,8 +506,8 @@ struct br_info br_log[CONFIG_BR_LOG_SIZE];
 
 uint64_t stable_log_begin, spec_log_begin;
 
-extern int ifetch_mmu_state;
-extern int data_mmu_state;
+extern HART_LOCAL int ifetch_mmu_state;
+extern HART_LOCAL int data_mmu_state;
 struct lightqs_reg_ss reg_ss, spec_reg_ss;
 void csr_writeback();
 void csr_prepare();
@@ -583,6 +711,16 @@ void fetch_decode(Decode *s, vaddr_t pc) {
   s->EHelper = g_exec_table[idx];
 }
 
+#ifdef CONFIG_TCACHE_FUSION
+// let `prev` run itself and the next instruction `s` as a macro-op
+bool fuse_decode(Decode *prev, Decode *s) {
+  int idx = isa_fuse(prev, s);
+  if (idx == EXEC_ID_inv) return false;
+  prev->EHelper = g_exec_table[idx];
+  return true;
+}
+#endif
+
 #ifdef CONFIG_PERF_OPT
 static void update_global() {
   update_instr_cnt();
@@ -590,28 +728,22 @@ static void update_global() {
 }
 #endif
 
-/* Simulate how the CPU works. */
-void cpu_exec(uint64_t n) {
-#ifndef CONFIG_LIGHTQS
-  IFDEF(CONFIG_SHARE, assert(n <= 1));
-#endif
-  g_print_step = (n < MAX_INSTR_TO_PRINT);
-  switch (nemu_state.state) {
-  case NEMU_END:
-  case NEMU_ABORT:
-    printf("Program execution has ended. To restart the program, exit NEMU and "
-           "run again.\n");
-#ifdef CONFIG_BR_LOG
-    printf("debug: bridx = %ld\n", br_count);
-#endif // CONFIG_BR_LOG
-    return;
-  default:
-    nemu_state.state = NEMU_RUNNING;
-    Loge("Setting NEMU state to RUNNING");
+// Restart the hart of the calling thread at pc, after its state is replaced
+// outside of cpu_exec(), e.g. by restoring a snapshot.
+void hart_set_pc(vaddr_t pc) {
+  cpu.pc = pc;
+#ifdef CONFIG_PERF_OPT
+  // before the first execute(), tcache is not initialized and the hart
+  // starts at cpu.pc
+  if (prev_s != NULL) {
+    tcache_handle_flush(pc);
+    g_sys_state_flag &= ~SYS_STATE_FLUSH_TCACHE;
   }
+#endif
+}
 
-  uint64_t timer_start = get_time();
-
+/* Run the hart of the calling thread for n instructions. */
+void hart_exec(uint64_t n) {
   n_remain_total = n; // + AHEAD_LENGTH; // deal with setjmp()
   Loge("cpu_exec will exec %lu instrunctions", n_remain_total);
   int cause;
@@ -629,8 +761,11 @@ void cpu_exec(uint64_t n) {
          MUXDEF(CONFIG_ENABLE_INSTR_CNT, n_remain_total > 0, true)) {
 #ifdef CONFIG_DEVICE
     extern void device_update();
-    device_update();
+    // the devices are shared by all harts and updated by hart 0
+    if (MUXDEF(CONFIG_MULTI_HART, g_hart_id == 0, true)) device_update();
 #endif
+    // take the timer and software interrupts of this hart from CLINT
+    IFDEF(CONFIG_MULTI_HART, update_clint());
 
 #ifndef CONFIG_SHARE
 #ifdef LIGHTQS
@@ -659,7 +794,8 @@ void cpu_exec(uint64_t n) {
       }
     }
 
-    int n_batch = n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total;
+    n_batch = next_batch();
+    update_per_bb_hook();
     n_remain = execute(n_batch);
 #ifdef CONFIG_PERF_OPT
     // return from execute
@@ -670,6 +806,31 @@ void cpu_exec(uint64_t n) {
 
 #endif
   }
+}
+
+/* Simulate how the CPU works. */
+void cpu_exec(uint64_t n) {
+#ifndef CONFIG_LIGHTQS
+  IFDEF(CONFIG_SHARE, assert(n <= 1));
+#endif
+  g_print_step = (n < MAX_INSTR_TO_PRINT);
+  switch (nemu_state.state) {
+  case NEMU_END:
+  case NEMU_ABORT:
+    printf("Program execution has ended. To restart the program, exit NEMU and "
+           "run again.\n");
+#ifdef CONFIG_BR_LOG
+    printf("debug: bridx = %ld\n", br_count);
+#endif // CONFIG_BR_LOG
+    return;
+  default:
+    nemu_state.state = NEMU_RUNNING;
+    Loge("Setting NEMU state to RUNNING");
+  }
+
+  uint64_t timer_start = get_time();
+
+  MUXDEF(CONFIG_MULTI_HART, harts_exec, hart_exec)(n);
 
 #ifndef CONFIG_SHARE
 #ifdef CONFIG_LIGHTQS
@@ -83,6 +83,9 @@ void difftest_memcpy(paddr_t nemu_addr, void *dut_buf, size_t n, bool direction)
   if (direction == DIFFTEST_TO_REF) memcpy(guest_to_host(nemu_addr), dut_buf, n);
   else memcpy(dut_buf, guest_to_host(nemu_addr), n);
 #endif
+#ifdef CONFIG_PMEM_DIRTY_TRACK
+  if (direction == DIFFTEST_TO_REF) pmem_dirty_mark(nemu_addr, n);
+#endif
 #endif
 }
 
@@ -0,0 +1,84 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <utils.h>
+#include <pthread.h>
+
+#ifdef CONFIG_MULTI_HART
+
+// Every hart runs on its own host thread, and the state of a hart is kept
+// in the thread local variables marked by HART_LOCAL. Hart 0 runs on the
+// main thread. The harts run in quanta: every hart runs `quantum`
+// instructions between two barriers, so no hart gets ahead of the others by
+// more than a quantum, and the main thread sees all harts stopped when
+// harts_exec() returns.
+
+HART_LOCAL int g_hart_id = 0;
+extern HART_LOCAL uint64_t g_nr_guest_instr;
+
+static pthread_t hart_thread[CONFIG_NR_HARTS];
+static pthread_barrier_t quantum_start, quantum_end;
+static uint64_t quantum = 0;
+static uint64_t hart_nr_instr[CONFIG_NR_HARTS] = {};
+
+static void *hart_main(void *arg) {
+  g_hart_id = (intptr_t)arg;
+  init_isa_hart(g_hart_id);
+  while (true) {
+    pthread_barrier_wait(&quantum_start);
+    hart_exec(quantum);
+    hart_nr_instr[g_hart_id] = g_nr_guest_instr;
+    pthread_barrier_wait(&quantum_end);
+  }
+  return NULL;
+}
+
+static void init_harts() {
+  pthread_barrier_init(&quantum_start, NULL, CONFIG_NR_HARTS);
+  pthread_barrier_init(&quantum_end, NULL, CONFIG_NR_HARTS);
+  for (intptr_t i = 1; i < CONFIG_NR_HARTS; i ++) {
+    int ret = pthread_create(&hart_thread[i], NULL, hart_main, (void *)i);
+    Assert(ret == 0, "Can not create the thread of hart %ld", i);
+  }
+  Log("Simulating %d harts, synchronized every %d instructions",
+      CONFIG_NR_HARTS, CONFIG_HART_QUANTUM);
+}
+
+void harts_exec(uint64_t n) {
+  static bool init = false;
+  if (!init) {
+    init_harts();
+    init = true;
+  }
+
+  while (nemu_state.state == NEMU_RUNNING && n > 0) {
+    quantum = (n < CONFIG_HART_QUANTUM ? n : CONFIG_HART_QUANTUM);
+    pthread_barrier_wait(&quantum_start);
+    hart_exec(quantum);
+    hart_nr_instr[0] = g_nr_guest_instr;
+    pthread_barrier_wait(&quantum_end);
+    n -= quantum;
+  }
+}
+
+void harts_statistic() {
+  for (int i = 0; i < CONFIG_NR_HARTS; i ++) {
+    Log("hart %d: guest instructions = %'ld", i, hart_nr_instr[i]);
+  }
+}
+
+#endif
@@ -13,50 +13,175 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+
 #include <cpu/decode.h>
 #include <cpu/cpu.h>
+#include <memory/vaddr.h>
+#include <cpu/jit.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 #ifdef CONFIG_PERF_OPT
 
-#define TCACHE_BB_SIZE (CONFIG_TCACHE_SIZE / 4 + 2)
+// records for the exception path and the basic block being built
+#define TCACHE_BB_RESERVE 4
+
+// Decoded instructions are owned by the guest page where their basic block
+// starts. Each page allocates its instructions from fixed-size chunks of
+// the tcache pool, so that a cold page can be evicted without flushing
+// the whole tcache.
+#define TCACHE_CHUNK_SIZE 32
+
+#if (CONFIG_BB_LIST_SIZE & (CONFIG_BB_LIST_SIZE - 1)) != 0
+#error "CONFIG_BB_LIST_SIZE should be a power of 2"
+#endif
+
+// the maximum number of tcache entries, can be set by --tcache-size
+uint64_t tcache_size = CONFIG_TCACHE_SIZE;
 
+// Indirect jumps keep their two most recent targets in tnext and ntnext.
+// Targets dropped from there are kept in a small inline cache of the jump,
+// which replaces the entry with the fewest hits.
+#define TCACHE_IC_SIZE 6
+
+typedef struct tc_ic_t {
+  Decode *target[TCACHE_IC_SIZE];
+  uint32_t hit[TCACHE_IC_SIZE];
+  uint32_t epoch; // targets are dropped when any page is evicted
+  struct tc_ic_t *next; // next inline cache in the free list
+} tc_ic_t;
+
+// basic block index with open addressing and linear probing
 typedef struct bb_t {
-  Decode *s;
-  struct bb_t *next;
   vaddr_t pc;
+  Decode *s;
 } bb_t;
 
-enum { BB_RECORD_TYPE_NTAKEN = 1, BB_RECORD_TYPE_TAKEN };
-
-static Decode tcache_pool[CONFIG_TCACHE_SIZE] = {};
-static int tc_idx = 0;
-static Decode tcache_bb_pool[TCACHE_BB_SIZE] = {};
-static Decode *tcache_bb_freelist = NULL;
-static bb_t bb_pool[CONFIG_BB_POOL_SIZE] = {};
-static int bb_idx = 0;
-static bb_t bb_list [CONFIG_BB_LIST_SIZE] = {};
-static const void *g_exec_nemu_decode;
+// Each entry in the tcache pool has a link node for its tnext and ntnext.
+// When the pointer refers to a basic block in another page, the node is
+// put into the incoming list of that page, so that the pointer can be
+// redirected when that page is evicted.
+typedef struct tc_link_t {
+  struct tc_link_t *prev, *next;
+} tc_link_t;
+
+typedef struct tc_page_t {
+  vaddr_t vpn;
+  struct tc_page_t *next; // next page in the hash list or in the free list
+  tc_link_t in_list;      // pointers from other pages into this page
+  int chunk;              // the chunk to allocate instructions from, chained
+                          // with the other chunks of the page by chunk_next[]
+  bool valid;
+  bool ref;               // reference bit for CLOCK replacement
+} tc_page_t;
+
+enum { BB_RECORD_TYPE_NTAKEN = 1, BB_RECORD_TYPE_TAKEN, BB_RECORD_TYPE_FREE };
+
+// The tcache pool and the basic block records are arenas reserved for the
+// maximum size. Host memory is only committed when a chunk is first used,
+// so the pools grow with the working set of the guest.
+static HART_LOCAL Decode *tcache_pool = NULL;
+static HART_LOCAL tc_link_t (*tcache_link)[2] = NULL; // indexed by is_taken
+static HART_LOCAL Decode *tcache_bb_pool = NULL;
+static HART_LOCAL Decode *tcache_bb_freelist = NULL;
+static HART_LOCAL int tcache_bb_nr_alloc = 0;
+static HART_LOCAL int tcache_bb_size = 0;
+static HART_LOCAL bb_t *bb_list = NULL;
+static HART_LOCAL uint64_t bb_list_mask = 0;
+static HART_LOCAL uint64_t bb_list_nr = 0;
+static HART_LOCAL const void *g_exec_nemu_decode;
+static HART_LOCAL const void *g_exec_tcache_link;
+
+static HART_LOCAL tc_ic_t *tcache_ic_pool = NULL;
+static HART_LOCAL tc_ic_t *tcache_ic_freelist = NULL;
+static HART_LOCAL int tcache_ic_nr_alloc = 0;
+static HART_LOCAL uint32_t tc_epoch = 0;
+
+static HART_LOCAL int tc_nr_chunk = 0;
+static HART_LOCAL tc_page_t *tc_page_pool = NULL;
+static HART_LOCAL tc_page_t **tc_page_list = NULL;
+static HART_LOCAL tc_page_t *tc_page_freelist = NULL;
+static HART_LOCAL int tc_clock_hand = 0;
+static HART_LOCAL tc_page_t **chunk_owner = NULL;
+static HART_LOCAL int *chunk_used = NULL;
+static HART_LOCAL int *chunk_next = NULL;
+static HART_LOCAL int *chunk_freelist = NULL;
+IFDEF(CONFIG_TCACHE_TRACE, static HART_LOCAL bool *chunk_trace = NULL); // chunks of superblocks
+static HART_LOCAL int chunk_nr_free = 0;
+static HART_LOCAL int chunk_nr_alloc = 0;
+static HART_LOCAL int chunk_now = -1;
+
+static HART_LOCAL struct {
+  uint64_t flush, evict, bb_list_grow;
+  uint64_t jr_ic_hit, jr_miss, trace, fuse;
+  int chunk_peak, bb_peak, ic_peak;
+} tc_stat = {};
+
+// defined in cpu-exec.c
+extern HART_LOCAL uint64_t jr_ras_hit, jr_mru_hit;
+void ras_flush();
 
 static inline Decode* tcache_entry_init(Decode *s, vaddr_t pc) {
   s->tnext = s->ntnext = NULL;
   s->type = 0;
+  s->ras_hint = RAS_HINT_NONE;
   s->pc = pc;
   s->EHelper = g_exec_nemu_decode;
   return s;
 }
 
+static inline int tcache_idx(Decode *s) {
+  uintptr_t idx = s - tcache_pool;
+  return (idx < (uintptr_t)tc_nr_chunk * TCACHE_CHUNK_SIZE ? idx : -1);
+}
+
+static inline tc_page_t* tcache_owner(Decode *s) {
+  int idx = tcache_idx(s);
+  return (idx >= 0 ? chunk_owner[idx / TCACHE_CHUNK_SIZE] : NULL);
+}
+
 static inline Decode* tcache_new(vaddr_t pc) {
-  if (tc_idx == CONFIG_TCACHE_SIZE) return NULL;
-  assert(tc_idx < CONFIG_TCACHE_SIZE);
-  Decode *s = &tcache_pool[tc_idx];
-  tc_idx ++;
-  return tcache_entry_init(s, pc);
+  assert(chunk_used[chunk_now] < TCACHE_CHUNK_SIZE);
+  int idx = chunk_now * TCACHE_CHUNK_SIZE + chunk_used[chunk_now];
+  chunk_used[chunk_now] ++;
+  // stale link nodes are dropped together with the page lists by tcache_flush()
+  tcache_link[idx][0].prev = tcache_link[idx][1].prev = NULL;
+  return tcache_entry_init(&tcache_pool[idx], pc);
+}
+
+static inline void tc_link_remove(tc_link_t *l) {
+  if (l->prev == NULL) return;
+  l->prev->next = l->next;
+  l->next->prev = l->prev;
+  l->prev = NULL;
+}
+
+static inline void tc_link_insert(tc_link_t *head, tc_link_t *l) {
+  l->next = head->next;
+  l->prev = head;
+  head->next->prev = l;
+  head->next = l;
+}
+
+// update tnext or ntnext, and track the pointer if it crosses pages
+static inline void tcache_set_next(Decode *src, int is_taken, Decode *dst) {
+  if (is_taken) { src->tnext = dst; }
+  else { src->ntnext = dst; }
+
+  int idx = tcache_idx(src);
+  if (idx < 0) return;
+  tc_link_t *l = &tcache_link[idx][is_taken];
+  tc_link_remove(l);
+  tc_page_t *p = tcache_owner(dst);
+  if (p != NULL && p != chunk_owner[idx / TCACHE_CHUNK_SIZE]) {
+    tc_link_insert(&p->in_list, l);
+  }
 }
 
 #ifdef CONFIG_RT_CHECK
 #define tcache_bb_check(s) do { \
   int idx = s - tcache_bb_pool; \
-  Assert(idx >= 0 && idx < TCACHE_BB_SIZE, "idx = %d, s = %p", idx, s); \
+  Assert(idx >= 0 && idx < tcache_bb_nr_alloc, "idx = %d, s = %p", idx, s); \
 } while (0)
 #else
 #define tcache_bb_check(s)
@@ -64,184 +189,619 @@ static inline Decode* tcache_new(vaddr_t pc) {
 
 static inline Decode* tcache_bb_new(vaddr_t pc) {
   Decode *s = tcache_bb_freelist;
-  assert(s != NULL);
+  if (s == NULL) {
+    // every basic block has at most two pending records for its successors,
+    // so the arena reserved in tcache_init() never runs out
+    assert(tcache_bb_nr_alloc < tcache_bb_size);
+    s = &tcache_bb_pool[tcache_bb_nr_alloc ++];
+    if (tcache_bb_nr_alloc > tc_stat.bb_peak) tc_stat.bb_peak = tcache_bb_nr_alloc;
+    return tcache_entry_init(s, pc);
+  }
   tcache_bb_check(s);
-  tcache_bb_check(tcache_bb_freelist->tnext);
   tcache_bb_freelist = tcache_bb_freelist->tnext;
-  tcache_bb_check(tcache_bb_freelist);
-  tcache_bb_check(tcache_bb_freelist->tnext);
   return tcache_entry_init(s, pc);
 }
 
 static inline void tcache_bb_free(Decode *s) {
   tcache_bb_check(s);
-  tcache_bb_check(tcache_bb_freelist);
   s->tnext = tcache_bb_freelist;
+  s->type = BB_RECORD_TYPE_FREE;
   tcache_bb_freelist = s;
-  tcache_bb_check(tcache_bb_freelist->tnext);
 }
 
+static inline bool tcache_bb_is_pending(Decode *s) {
+  return (uintptr_t)(s - tcache_bb_pool) < (uintptr_t)tcache_bb_nr_alloc &&
+    (s->type == BB_RECORD_TYPE_TAKEN || s->type == BB_RECORD_TYPE_NTAKEN);
+}
+
+
+static inline uint64_t bb_hash(vaddr_t pc) {
+  return ((pc / CONFIG_ILEN_MIN) * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static void bb_list_resize(uint64_t size) {
+  bb_t *old = bb_list;
+  uint64_t old_size = (old == NULL ? 0 : bb_list_mask + 1);
+  bb_list = malloc(sizeof(bb_t) * size);
+  assert(bb_list != NULL);
+  memset(bb_list, -1, sizeof(bb_t) * size);
+  bb_list_mask = size - 1;
+  uint64_t i;
+  for (i = 0; i < old_size; i ++) {
+    if (old[i].pc == (vaddr_t)-1ul) continue;
+    uint64_t j = bb_hash(old[i].pc) & bb_list_mask;
+    while (bb_list[j].pc != (vaddr_t)-1ul) j = (j + 1) & bb_list_mask;
+    bb_list[j] = old[i];
+  }
+  free(old);
+}
 
-static inline bb_t* bb_new(Decode *s, vaddr_t pc, bb_t *next) {
-  if (bb_idx == CONFIG_BB_POOL_SIZE) return NULL;
-  assert(bb_idx < CONFIG_BB_POOL_SIZE);
-  bb_t *bb = &bb_pool[bb_idx ++];
-  bb->s = s;
-  bb->pc = pc;
-  bb->next = next;
-  return bb;
+static void bb_insert(vaddr_t pc, Decode *fill) {
+  // keep the load factor below 1/2
+  if ((bb_list_nr + 1) * 2 > bb_list_mask + 1) {
+    bb_list_resize((bb_list_mask + 1) * 2);
+    tc_stat.bb_list_grow ++;
+  }
+  uint64_t i = bb_hash(pc) & bb_list_mask;
+  while (bb_list[i].pc != (vaddr_t)-1ul) i = (i + 1) & bb_list_mask;
+  bb_list[i].pc = pc;
+  bb_list[i].s = fill;
+  bb_list_nr ++;
 }
 
-static inline bb_t* bb_hash(vaddr_t pc) {
-  int idx = (pc / CONFIG_ILEN_MIN) % CONFIG_BB_LIST_SIZE;
-  return &bb_list[idx];
+static inline Decode* bb_find(vaddr_t pc) {
+  uint64_t i = bb_hash(pc) & bb_list_mask;
+  while (true) {
+    bb_t *bb = &bb_list[i];
+    if (likely(bb->pc == pc)) return bb->s;
+    if (bb->pc == (vaddr_t)-1ul) return NULL;
+    i = (i + 1) & bb_list_mask;
+  }
+}
+
+static void bb_remove(vaddr_t pc, Decode *s) {
+  uint64_t i = bb_hash(pc) & bb_list_mask;
+  while (bb_list[i].pc != pc || bb_list[i].s != s) {
+    if (bb_list[i].pc == (vaddr_t)-1ul) return;
+    i = (i + 1) & bb_list_mask;
+  }
+  // shift the following entries backward to fill the hole
+  uint64_t j = i;
+  while (true) {
+    j = (j + 1) & bb_list_mask;
+    if (bb_list[j].pc == (vaddr_t)-1ul) break;
+    uint64_t home = bb_hash(bb_list[j].pc) & bb_list_mask;
+    if (((j - home) & bb_list_mask) >= ((j - i) & bb_list_mask)) {
+      bb_list[i] = bb_list[j];
+      i = j;
+    }
+  }
+  bb_list[i].pc = (vaddr_t)-1ul;
+  bb_list_nr --;
+}
+
+static tc_ic_t* tcache_ic_new() {
+  tc_ic_t *ic = tcache_ic_freelist;
+  if (ic != NULL) { tcache_ic_freelist = ic->next; }
+  else {
+    // there is at most one inline cache for each tcache entry
+    ic = &tcache_ic_pool[tcache_ic_nr_alloc ++];
+    if (tcache_ic_nr_alloc > tc_stat.ic_peak) tc_stat.ic_peak = tcache_ic_nr_alloc;
+  }
+  memset(ic, 0, sizeof(*ic));
+  ic->epoch = tc_epoch;
+  return ic;
+}
+
+static inline void tcache_ic_free(tc_ic_t *ic) {
+  ic->next = tcache_ic_freelist;
+  tcache_ic_freelist = ic;
+}
+
+static Decode* tcache_ic_lookup(tc_ic_t *ic, vaddr_t jpc) {
+  if (ic->epoch != tc_epoch) {
+    memset(ic->target, 0, sizeof(ic->target));
+    ic->epoch = tc_epoch;
+    return NULL;
+  }
+  int i;
+  for (i = 0; i < TCACHE_IC_SIZE; i ++) {
+    if (ic->target[i] != NULL && ic->target[i]->pc == jpc) {
+      ic->hit[i] ++;
+      return ic->target[i];
+    }
+  }
+  return NULL;
+}
+
+static void tcache_ic_insert(tc_ic_t *ic, Decode *target) {
+  int i, victim = -1;
+  for (i = 0; i < TCACHE_IC_SIZE; i ++) {
+    if (ic->target[i] == target) return;
+    if (ic->target[i] == NULL) { victim = i; break; }
+  }
+  if (victim == -1) {
+    victim = 0;
+    for (i = 0; i < TCACHE_IC_SIZE; i ++) {
+      if (ic->hit[i] < ic->hit[victim]) victim = i;
+      // age the counters so that old targets can be replaced
+      ic->hit[i] >>= 1;
+    }
+  }
+  ic->target[victim] = target;
+  ic->hit[victim] = 0;
+}
+
+static inline void tc_page_touch(Decode *s) {
+  tc_page_t *p = tcache_owner(s);
+  if (p != NULL) p->ref = true;
+}
+
+static inline tc_page_t** tc_page_hash(vaddr_t vpn) {
+  return &tc_page_list[vpn % tc_nr_chunk];
+}
+
+static tc_page_t* tc_page_find(vaddr_t vpn) {
+  tc_page_t *p;
+  for (p = *tc_page_hash(vpn); p != NULL; p = p->next) {
+    if (p->vpn == vpn) return p;
+  }
+  return NULL;
+}
+
+static inline bool tc_chunk_available() {
+  return chunk_nr_free > 0 || chunk_nr_alloc < tc_nr_chunk;
+}
+
+static int tc_chunk_alloc(tc_page_t *p) {
+  int c;
+  if (chunk_nr_free > 0) { c = chunk_freelist[-- chunk_nr_free]; }
+  else {
+    // grow the tcache
+    assert(chunk_nr_alloc < tc_nr_chunk);
+    c = chunk_nr_alloc ++;
+    if (chunk_nr_alloc > tc_stat.chunk_peak) tc_stat.chunk_peak = chunk_nr_alloc;
+  }
+  chunk_owner[c] = p;
+  chunk_used[c] = 0;
+  IFDEF(CONFIG_TCACHE_TRACE, chunk_trace[c] = false);
+  IFDEF(CONFIG_ENGINE_JIT, jit_chunk_reset(c));
+  return c;
+}
+
+static void tc_chunk_new(tc_page_t *p) {
+  int c = tc_chunk_alloc(p);
+  chunk_next[c] = p->chunk;
+  p->chunk = c;
+}
+
+static tc_page_t* tc_page_new(vaddr_t vpn) {
+  tc_page_t *p = tc_page_freelist;
+  assert(p != NULL);
+  tc_page_freelist = p->next;
+  tc_page_t **head = tc_page_hash(vpn);
+  p->vpn = vpn;
+  p->next = *head;
+  p->in_list.prev = p->in_list.next = &p->in_list;
+  p->valid = true;
+  p->ref = false;
+  p->chunk = -1;
+  *head = p;
+  tc_chunk_new(p);
+  return p;
+}
+
+static void tcache_bb_fetch(Decode *_this, int is_taken, vaddr_t jpc);
+
+// drop the pending record from `src` without patching, since `src` is evicted
+static inline void tcache_bb_drop(Decode *src, Decode *r, Decode *keep) {
+  if (tcache_bb_is_pending(r) && r->bb_src == src) {
+    r->type = 0;
+    if (r != keep) tcache_bb_free(r);
+  }
 }
 
-static struct bb_t* bb_insert(vaddr_t pc, Decode *fill) {
-  bb_t *head = bb_hash(pc);
-  if (head->next == (void *)-1ul) {
-    if (head->pc == (vaddr_t)-1ul) {
-      // first time
-      head->s = fill;
-      head->pc = pc;
-      return head;
+// Evict all basic blocks in a page. `keep` is the record being decoded,
+// which is still in use even if its source is evicted.
+static void tc_page_evict(tc_page_t *p, Decode *keep) {
+  int c, i;
+  for (c = p->chunk; c != -1; c = chunk_next[c]) {
+    for (i = 0; i < chunk_used[c]; i ++) {
+      int idx = c * TCACHE_CHUNK_SIZE + i;
+      Decode *s = &tcache_pool[idx];
+      tc_link_remove(&tcache_link[idx][0]);
+      tc_link_remove(&tcache_link[idx][1]);
+      if (s->type != INSTR_TYPE_N) {
+        tcache_bb_drop(s, s->tnext, keep);
+        tcache_bb_drop(s, s->ntnext, keep);
+      }
+      if (s->type == INSTR_TYPE_I && s->ic != NULL) tcache_ic_free(s->ic);
+      if (s->idx_in_bb == 1) bb_remove(s->pc, s);
     }
   }
-  // second time
-  bb_t *bb = bb_new(head->s, head->pc, head->next);
-  if (bb == NULL) return NULL;
-  head->s = fill;
-  head->pc = pc;
-  head->next = bb;
-  return head;
-}
-
-static bb_t* bb_find(vaddr_t pc) {
-  bb_t *bb = bb_hash(pc);
-  if (likely(bb->pc == pc)) return bb;
-  bb_t *head = bb;
-  do {
-    bb = bb->next;
-    if (bb == (void *)-1ul) return NULL;
-    if (bb->pc == pc) {
-      Decode *tmp_s = bb->s; vaddr_t tmp_pc = bb->pc;
-      bb->s = head->s; bb->pc = head->pc;
-      head->s = tmp_s; head->pc = tmp_pc;
-      return head;
+
+  // redirect the pointers from other pages, the evicted
+  // entries are still valid until their chunks are reused
+  while (p->in_list.next != &p->in_list) {
+    tc_link_t *l = p->in_list.next;
+    int idx = (l - &tcache_link[0][0]) / 2;
+    int is_taken = (l - &tcache_link[0][0]) % 2;
+    Decode *s = &tcache_pool[idx];
+    if (s->type == INSTR_TYPE_I) {
+      // the targets of indirect jumps are updated dynamically
+      tcache_set_next(s, is_taken, s);
+    } else {
+      tcache_bb_fetch(s, is_taken, (is_taken ? s->tnext : s->ntnext)->pc);
     }
-  } while (1);
+  }
+
+  for (c = p->chunk; c != -1; c = chunk_next[c]) {
+    chunk_owner[c] = NULL;
+    chunk_freelist[chunk_nr_free ++] = c;
+  }
+
+  tc_page_t **pp = tc_page_hash(p->vpn);
+  while (*pp != p) pp = &(*pp)->next;
+  *pp = p->next;
+  p->valid = false;
+  p->next = tc_page_freelist;
+  tc_page_freelist = p;
+  tc_stat.evict ++;
+
+  // drop the pointers to the evicted basic blocks without link nodes
+  tc_epoch ++;
+  ras_flush();
+}
+
+static tc_page_t* tc_page_clock_victim() {
+  while (true) {
+    tc_page_t *p = &tc_page_pool[tc_clock_hand];
+    tc_clock_hand = (tc_clock_hand + 1) % tc_nr_chunk;
+    if (!p->valid) continue;
+    if (p->ref) { p->ref = false; continue; }
+    return p;
+  }
+}
+
+// allocate the first entry of a basic block in the page of pc
+static Decode* tcache_bb_start(vaddr_t pc, Decode *bb_record) {
+  vaddr_t vpn = pc >> PAGE_SHIFT;
+  tc_page_t *p;
+  bool need_chunk;
+  while (true) {
+    p = tc_page_find(vpn);
+    // a basic block starts with at least two free entries, see tcache_need_link()
+    need_chunk = (p == NULL || TCACHE_CHUNK_SIZE - chunk_used[p->chunk] < 2);
+    if (need_chunk && !tc_chunk_available()) {
+      tc_page_evict(tc_page_clock_victim(), bb_record);
+    } else break;
+  }
+  if (p == NULL) { p = tc_page_new(vpn); }
+  else if (need_chunk) { tc_chunk_new(p); }
+  p->ref = true;
+  chunk_now = p->chunk;
+  return tcache_new(pc);
 }
 
 static void tcache_bb_fetch(Decode *_this, int is_taken, vaddr_t jpc) {
-  bb_t* bb = bb_find(jpc);
+  Decode *bb = bb_find(jpc);
   if (bb != NULL) {
-    if (is_taken) { _this->tnext = bb->s; }
-    else { _this->ntnext = bb->s; }
+    tc_page_touch(bb);
+    tcache_set_next(_this, is_taken, bb);
   } else {
     Decode *ret = tcache_bb_new(jpc);
-    if (is_taken) { ret->type = BB_RECORD_TYPE_TAKEN; _this->tnext = ret; }
-    else { ret->type = BB_RECORD_TYPE_NTAKEN; _this->ntnext = ret; }
+    ret->type = (is_taken ? BB_RECORD_TYPE_TAKEN : BB_RECORD_TYPE_NTAKEN);
     ret->bb_src = _this;
+    tcache_set_next(_this, is_taken, ret);
   }
 }
 
+enum { TCACHE_BB_BUILDING, TCACHE_RUNNING };
+static HART_LOCAL int tcache_state = TCACHE_RUNNING;
+static HART_LOCAL Decode *bb_now = NULL, *bb_now_record = NULL;
+
 void tcache_flush() {
-  tc_idx = 0;
-  bb_idx = 0;
-  memset(bb_list, -1, sizeof(bb_list));
+  memset(bb_list, -1, sizeof(bb_t) * (bb_list_mask + 1));
+  bb_list_nr = 0;
+
+  tcache_bb_freelist = NULL;
+  tcache_bb_nr_alloc = 0;
+  tcache_ic_freelist = NULL;
+  tcache_ic_nr_alloc = 0;
+  tc_epoch ++;
+  ras_flush();
 
   int i;
-  for (i = 0; i < TCACHE_BB_SIZE - 1; i ++) {
-    tcache_bb_pool[i].list_next = &tcache_bb_pool[i + 1];
+  tc_page_freelist = NULL;
+  for (i = tc_nr_chunk - 1; i >= 0; i --) {
+    tc_page_pool[i].valid = false;
+    tc_page_pool[i].next = tc_page_freelist;
+    tc_page_freelist = &tc_page_pool[i];
+    tc_page_list[i] = NULL;
+    chunk_owner[i] = NULL;
   }
-  tcache_bb_pool[TCACHE_BB_SIZE - 1].list_next = NULL;
-  tcache_bb_freelist = &tcache_bb_pool[0];
-}
+  chunk_nr_free = 0;
+  chunk_nr_alloc = 0;
+  chunk_now = -1;
+  tc_clock_hand = 0;
 
-enum { TCACHE_BB_BUILDING, TCACHE_RUNNING };
-static int tcache_state = TCACHE_RUNNING;
-static Decode *bb_now = NULL, *bb_now_record = NULL;
+  bb_now = bb_now_record = NULL;
+  tcache_state = TCACHE_RUNNING;
+  tc_stat.flush ++;
+}
 
 __attribute__((noinline))
 Decode* tcache_jr_fetch(Decode *s, vaddr_t jpc) {
-  s->ntnext = s->tnext;
+  if (s->ic != NULL) {
+    Decode *target = tcache_ic_lookup(s->ic, jpc);
+    if (target != NULL) { tc_stat.jr_ic_hit ++; return target; }
+  }
+  tc_stat.jr_miss ++;
+
+  Decode *victim = s->ntnext;
+  tcache_set_next(s, false, s->tnext);
   tcache_bb_fetch(s, true, jpc);
+  // only keep decoded basic blocks, pending records are freed after decoding
+  if (victim != s && tcache_idx(victim) >= 0) {
+    if (s->ic == NULL) s->ic = tcache_ic_new();
+    tcache_ic_insert(s->ic, victim);
+  }
   return s->tnext;
 }
 
+// fetch the basic block after a direct call
+__attribute__((noinline))
+Decode* tcache_ras_fetch(Decode *call) {
+  tcache_bb_fetch(call, false, call->snpc);
+  return call->ntnext;
+}
+
 static inline void tcache_patch_and_free(Decode *bb_record, Decode *bb) {
   Decode *src = bb_record->bb_src;
-  if (bb_record->type == BB_RECORD_TYPE_TAKEN)  { src->tnext = bb; }
-  if (bb_record->type == BB_RECORD_TYPE_NTAKEN) { src->ntnext = bb; }
+  if (bb_record->type == BB_RECORD_TYPE_TAKEN)  { tcache_set_next(src, true, bb); }
+  if (bb_record->type == BB_RECORD_TYPE_NTAKEN) { tcache_set_next(src, false, bb); }
   tcache_bb_free(bb_record);
 }
 
+// A basic block can not grow across the end of its chunk or its page.
+// In this case the last entry becomes a link to the basic block starting
+// from its pc. Note that the first entry of a basic block never needs a
+// link, since the basic block always starts with at least two free entries.
+static inline bool tcache_need_link(Decode *s) {
+  return (s - tcache_pool) % TCACHE_CHUNK_SIZE == TCACHE_CHUNK_SIZE - 1 ||
+    (s->pc >> PAGE_SHIFT) != (bb_now->pc >> PAGE_SHIFT);
+}
+
 __attribute__((noinline))
 Decode* tcache_decode(Decode *s) {
-  static int idx_in_bb = 0;
+  static HART_LOCAL int idx_in_bb = 0;
   vaddr_t thispc = s->pc;
 
   if (tcache_state == TCACHE_RUNNING) {  // start of a basic block
     // first check whether this basic block is already decoded
-    bb_t *bb = bb_find(thispc);
+    Decode *bb = bb_find(thispc);
     if (bb != NULL) { // already decoded
-      tcache_patch_and_free(s, bb->s);
-      return bb->s;
+      tc_page_touch(bb);
+      tcache_patch_and_free(s, bb);
+      return bb;
     }
 
     Decode *old = s;
-    s = tcache_new(thispc);
+    s = tcache_bb_start(thispc, old);
     idx_in_bb = 1;
-    if (s == NULL) { goto full; }
 
     bb_now_record = old;
     bb_now = s;
     tcache_state = TCACHE_BB_BUILDING;
+  } else if (tcache_need_link(s)) {
+    s->EHelper = g_exec_tcache_link;
+    s->type = INSTR_TYPE_J;
+    s->jnpc = thispc;
+    s->idx_in_bb = idx_in_bb - 1;
+    goto end_of_bb;
   }
 
   save_globals(s);
   s->idx_in_bb = idx_in_bb;
   fetch_decode(s, thispc); // note that exception may happen!
+  IFDEF(CONFIG_TCACHE_FUSION, if (idx_in_bb > 1 && fuse_decode(s - 1, s)) tc_stat.fuse ++);
 
   if (s->type == INSTR_TYPE_N) {
     Decode *next = tcache_new(s->snpc);
-    if (next == NULL) { goto full; }
     assert(next == s + 1);
-  } else {
-    // the end of the basic block
-    bb_t *ret = bb_insert(bb_now->pc, bb_now);
-    if (ret == NULL) { goto full; } // basic block list is full
-    tcache_patch_and_free(bb_now_record, bb_now);
-    bb_now = bb_now_record = NULL;
-
-    switch (s->type) {
-      case INSTR_TYPE_J: tcache_bb_fetch(s, true, s->jnpc); break;
-      case INSTR_TYPE_B:
-        tcache_bb_fetch(s, true, s->jnpc);
-        tcache_bb_fetch(s, false, s->snpc + MUXDEF(__ISA_mips32__, 4, 0));
-        break;
-      case INSTR_TYPE_I: s->tnext = s->ntnext = s; break; // update dynamically
-      default: assert(0);
-    }
-    tcache_state = TCACHE_RUNNING;
+    idx_in_bb ++;
+    return s;
   }
 
+end_of_bb:;
+  // the end of the basic block
+  bb_insert(bb_now->pc, bb_now);
+  tcache_patch_and_free(bb_now_record, bb_now);
+  bb_now = bb_now_record = NULL;
+
+  switch (s->type) {
+    case INSTR_TYPE_J: tcache_bb_fetch(s, true, s->jnpc); break;
+    case INSTR_TYPE_B:
+      tcache_bb_fetch(s, true, s->jnpc);
+      tcache_bb_fetch(s, false, s->snpc + MUXDEF(__ISA_mips32__, 4, 0));
+      break;
+    case INSTR_TYPE_I: // update dynamically
+      s->tnext = s->ntnext = s;
+      s->ic = NULL;
+      break;
+    default: assert(0);
+  }
+  // jnpc is no longer used, and the counters are used for superblocks
+  IFDEF(CONFIG_TCACHE_TRACE, if (s->type != INSTR_TYPE_I) s->br_cnt[0] = s->br_cnt[1] = 0);
+  tcache_state = TCACHE_RUNNING;
   idx_in_bb ++;
   return s;
+}
 
-full:
-  tcache_flush();
-  s = tcache_bb_new(thispc); // decode this instruction again
-  s->idx_in_bb = idx_in_bb;
-  save_globals(s);
-  bb_now = bb_now_record = NULL;
-  tcache_state = TCACHE_RUNNING;
-  longjmp_exec(NEMU_EXEC_AGAIN);
+#ifdef CONFIG_TCACHE_TRACE
+// A superblock is formed from a hot loop. The decoded basic blocks along the
+// hot path are copied into a chunk of the page of the loop head, so that the
+// hot successor of every basic block is the next entry, which execute() runs
+// without the bookkeeping at the end of a basic block. The cold successors
+// are side exits to the original basic blocks. The original loop head
+// becomes a link to the superblock.
+#define TCACHE_TRACE_MAX_BB 16
+
+static inline bool tcache_is_link(Decode *s) {
+  return s->EHelper == g_exec_tcache_link;
+}
+
+// return the number of entries to copy for the basic block starting from
+// `bb` with the last instruction `*end`, or 0 if it is not fully decoded
+static int tcache_trace_bb_len(Decode *bb, Decode **end) {
+  int len = 0;
+  Decode *s = bb;
+  while (true) {
+    if (tcache_is_link(s)) {
+      s = s->tnext;
+      if (tcache_idx(s) < 0) return 0;
+      continue;
+    }
+    len ++;
+    if (s->type != INSTR_TYPE_N) { *end = s; return len; }
+    s ++;
+  }
+}
+
+// copy a basic block without its links, return the copy of the last instruction
+static Decode* tcache_trace_copy(Decode *dst, Decode *bb, Decode *end) {
+  Decode *s = bb;
+  int idx = 1;
+  while (true) {
+    if (tcache_is_link(s)) { s = s->tnext; continue; }
+    *dst = *s;
+    IFDEF(CONFIG_ENGINE_JIT, jit_restore(dst));
+    dst->idx_in_bb = idx ++;
+    dst->tnext = dst->ntnext = NULL;
+    int i = tcache_idx(dst);
+    tcache_link[i][0].prev = tcache_link[i][1].prev = NULL;
+    if (s == end) return dst;
+    s ++;
+    dst ++;
+  }
+}
+
+static void tcache_trace_exit(Decode *s, int is_taken, Decode *orig, Decode *next) {
+  if (next != NULL) tcache_set_next(s, is_taken, next);
+  else tcache_bb_fetch(s, is_taken, (is_taken ? orig->tnext : orig->ntnext)->pc);
+}
+
+// called by execute() when the backward jump `src` to `next` is hot
+Decode* tcache_trace(Decode *src, Decode *next) {
+  src->br_cnt[0] = src->br_cnt[1] = 0;
+  Decode *head = bb_find(next->pc);
+  int hidx = (head == NULL ? -1 : tcache_idx(head));
+  if (hidx < 0 || chunk_trace[hidx / TCACHE_CHUNK_SIZE]) return next;
+
+  // follow the hot successors from the loop head
+  Decode *bb[TCACHE_TRACE_MAX_BB], *end[TCACHE_TRACE_MAX_BB];
+  bool hot_taken[TCACHE_TRACE_MAX_BB];
+  int nr_bb = 0, len = 0;
+  bool closed = false;
+  Decode *s = head;
+  while (nr_bb < TCACHE_TRACE_MAX_BB) {
+    Decode *e;
+    int l = tcache_trace_bb_len(s, &e);
+    if (l == 0 || len + l > TCACHE_CHUNK_SIZE) break;
+    bb[nr_bb] = s;
+    end[nr_bb] = e;
+    len += l;
+    nr_bb ++;
+    if (e->type == INSTR_TYPE_I) break;
+    bool is_taken = (e->type == INSTR_TYPE_J || e->br_cnt[1] >= e->br_cnt[0]);
+    hot_taken[nr_bb - 1] = is_taken;
+    Decode *succ = (is_taken ? e->tnext : e->ntnext);
+    if (succ->pc == head->pc) { closed = true; break; }
+    s = bb_find(succ->pc);
+    if (s == NULL) break;
+  }
+  int i;
+  // superblocks are not formed when the tcache is full
+  if (nr_bb < 2 || !tc_chunk_available()) {
+#ifdef CONFIG_ENGINE_JIT
+    // translate the hot basic blocks where they are, if they are not split
+    for (i = 0; i < nr_bb; i ++) {
+      Decode *e;
+      if (tcache_trace_bb_len(bb[i], &e) == end[i] - bb[i] + 1) {
+        jit_translate(tcache_idx(bb[i]) / TCACHE_CHUNK_SIZE, bb[i], end[i]);
+      }
+    }
+#endif
+    return next;
+  }
+
+  tc_page_t *p = chunk_owner[hidx / TCACHE_CHUNK_SIZE];
+  int c = tc_chunk_alloc(p);
+  chunk_used[c] = len;
+  chunk_next[c] = chunk_next[p->chunk];
+  chunk_next[p->chunk] = c;
+  chunk_trace[c] = true;
+
+  Decode *t = &tcache_pool[c * TCACHE_CHUNK_SIZE];
+  bb_remove(head->pc, head);
+  bb_insert(head->pc, t);
+
+  Decode *dst = t;
+  for (i = 0; i < nr_bb; i ++) {
+    Decode *e = tcache_trace_copy(dst, bb[i], end[i]);
+    IFDEF(CONFIG_ENGINE_JIT, jit_translate(c, dst, e));
+    dst = e + 1;
+    switch (e->type) {
+      case INSTR_TYPE_I: e->tnext = e->ntnext = e; e->ic = NULL; continue;
+      case INSTR_TYPE_J: e->br_cnt[0] = e->br_cnt[1] = 0; break;
+      case INSTR_TYPE_B: e->br_cnt[0] = e->br_cnt[1] = 0; break;
+      default: assert(0);
+    }
+    bool is_taken = hot_taken[i];
+    Decode *hot = (i < nr_bb - 1 ? dst : (closed ? t : NULL));
+    tcache_trace_exit(e, is_taken, end[i], hot);
+    if (e->type == INSTR_TYPE_B) tcache_trace_exit(e, !is_taken, end[i], NULL);
+  }
+
+  // the pointers to the original loop head are redirected by a link
+  if (head->type != INSTR_TYPE_N) {
+    tcache_bb_drop(head, head->tnext, NULL);
+    tcache_bb_drop(head, head->ntnext, NULL);
+    if (head->type == INSTR_TYPE_I && head->ic != NULL) tcache_ic_free(head->ic);
+  }
+  tcache_set_next(head, false, NULL);
+  head->EHelper = g_exec_tcache_link;
+  head->type = INSTR_TYPE_J;
+  head->ras_hint = RAS_HINT_NONE;
+  head->idx_in_bb = 0;
+  tcache_set_next(head, true, t);
+
+  tc_stat.trace ++;
+  return (next == head ? t : next);
 }
+#endif
 
-static Decode ex = {};
+static HART_LOCAL Decode ex = {};
+
+// drop the basic block being built when an exception interrupts it
+static void tcache_bb_abort() {
+  int c = tcache_idx(bb_now) / TCACHE_CHUNK_SIZE;
+  chunk_used[c] = bb_now - &tcache_pool[c * TCACHE_CHUNK_SIZE];
+
+  // a pending record from a direct jump or branch is decoded
+  // again when its source is executed, others can be freed
+  Decode *r = bb_now_record, *src = r->bb_src;
+  if (!tcache_bb_is_pending(r)) { tcache_bb_free(r); }
+  else if (src == &ex) { tcache_bb_free(r); }
+  else if (src->type == INSTR_TYPE_I) {
+    tcache_set_next(src, true, src);
+    tcache_bb_free(r);
+  }
+  bb_now = bb_now_record = NULL;
+}
 
 void tcache_handle_exception(vaddr_t jpc) {
+  if (tcache_state == TCACHE_BB_BUILDING) tcache_bb_abort();
   tcache_bb_fetch(&ex, true, jpc);
   save_globals(ex.tnext);
   tcache_state = TCACHE_RUNNING;
@@ -253,9 +813,70 @@ Decode* tcache_handle_flush(vaddr_t snpc) {
   return ex.tnext;
 }
 
-Decode* tcache_init(const void *exec_nemu_decode, vaddr_t reset_vector) {
+static void* tcache_arena_new(size_t size) {
+  // only reserve the address space, host pages are committed on first use
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(p != MAP_FAILED, "failed to reserve %zu bytes for tcache", size);
+  return p;
+}
+
+void tcache_statistic() {
+  if (tcache_pool == NULL) return;
+  uint64_t i, probe_total = 0, probe_max = 0;
+  for (i = 0; i <= bb_list_mask; i ++) {
+    if (bb_list[i].pc == (vaddr_t)-1ul) continue;
+    uint64_t d = (i - bb_hash(bb_list[i].pc)) & bb_list_mask;
+    probe_total += d + 1;
+    if (d + 1 > probe_max) probe_max = d + 1;
+  }
+  Log("tcache: %'d/%'d chunks in use (peak %'d), %'lu flushes, %'lu page evictions, %'lu superblocks",
+      chunk_nr_alloc - chunk_nr_free, tc_nr_chunk, tc_stat.chunk_peak,
+      tc_stat.flush, tc_stat.evict, tc_stat.trace);
+  IFDEF(CONFIG_TCACHE_FUSION, Log("tcache: %'lu instruction pairs fused", tc_stat.fuse));
+  Log("tcache: bb index %'lu/%'lu entries, %'lu grows, chain length avg %.2f max %'lu",
+      bb_list_nr, bb_list_mask + 1, tc_stat.bb_list_grow,
+      bb_list_nr == 0 ? 0.0 : (double)probe_total / bb_list_nr, probe_max);
+  Log("tcache: bb records peak %'d/%'d, inline caches peak %'d",
+      tc_stat.bb_peak, tcache_bb_size, tc_stat.ic_peak);
+  uint64_t jr_hit = jr_ras_hit + jr_mru_hit + tc_stat.jr_ic_hit;
+  uint64_t jr_total = jr_hit + tc_stat.jr_miss;
+  Log("tcache: indirect jumps %'lu, hit rate %.2f%% (RAS %'lu, MRU %'lu, inline cache %'lu)",
+      jr_total, jr_total == 0 ? 0.0 : 100.0 * jr_hit / jr_total,
+      jr_ras_hit, jr_mru_hit, tc_stat.jr_ic_hit);
+}
+
+Decode* tcache_init(const void *exec_nemu_decode, const void *exec_tcache_link,
+    vaddr_t reset_vector) {
+  tc_nr_chunk = tcache_size / TCACHE_CHUNK_SIZE;
+  Assert(tc_nr_chunk >= 2, "tcache size %lu is too small, should be at least %d",
+      tcache_size, 2 * TCACHE_CHUNK_SIZE);
+  size_t nr_entry = (size_t)tc_nr_chunk * TCACHE_CHUNK_SIZE;
+  tcache_pool = tcache_arena_new(sizeof(Decode) * nr_entry);
+  tcache_link = tcache_arena_new(sizeof(tc_link_t) * 2 * nr_entry);
+  tcache_bb_size = 2 * nr_entry + TCACHE_BB_RESERVE;
+  tcache_bb_pool = tcache_arena_new(sizeof(Decode) * tcache_bb_size);
+  tcache_ic_pool = tcache_arena_new(sizeof(tc_ic_t) * nr_entry);
+  tc_page_pool = calloc(tc_nr_chunk, sizeof(tc_page_t));
+  tc_page_list = calloc(tc_nr_chunk, sizeof(tc_page_t *));
+  chunk_owner = calloc(tc_nr_chunk, sizeof(tc_page_t *));
+  chunk_used = calloc(tc_nr_chunk, sizeof(int));
+  chunk_next = calloc(tc_nr_chunk, sizeof(int));
+  chunk_freelist = calloc(tc_nr_chunk, sizeof(int));
+#ifdef CONFIG_TCACHE_TRACE
+  chunk_trace = calloc(tc_nr_chunk, sizeof(bool));
+  assert(chunk_trace);
+#endif
+  assert(tc_page_pool && tc_page_list && chunk_owner && chunk_used &&
+      chunk_next && chunk_freelist);
+  bb_list_resize(CONFIG_BB_LIST_SIZE);
+  IFDEF(CONFIG_ENGINE_JIT, jit_code_init(tc_nr_chunk, TCACHE_CHUNK_SIZE));
+  Log("tcache: at most %'zu entries", nr_entry);
+
   tcache_flush();
+  tc_stat.flush = 0;
   g_exec_nemu_decode = exec_nemu_decode;
+  g_exec_tcache_link = exec_tcache_link;
   return tcache_bb_new(reset_vector);
 }
 #endif
@@ -24,6 +24,17 @@
 static uint8_t io_space[IO_SPACE_MAX] PG_ALIGN = {};
 static uint8_t *p_space = io_space;
 
+#ifdef CONFIG_MULTI_HART
+#include <pthread.h>
+// the devices are accessed by one hart at a time
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+#define io_lock()   pthread_mutex_lock(&io_lock)
+#define io_unlock() pthread_mutex_unlock(&io_lock)
+#else
+#define io_lock()
+#define io_unlock()
+#endif
+
 uint8_t* new_space(int size) {
   uint8_t *p = p_space;
   // page aligned;
@@ -47,14 +58,19 @@ word_t map_read(paddr_t addr, int len, IOMap *map) {
   assert(len >= 1 && len <= 8);
   check_bound(map, addr);
   paddr_t offset = addr - map->low;
+  io_lock();
   invoke_callback(map->callback, offset, len, false); // prepare data to read
-  return host_read(map->space + offset, len);
+  word_t ret = host_read(map->space + offset, len);
+  io_unlock();
+  return ret;
 }
 
 void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
   assert(len >= 1 && len <= 8);
   check_bound(map, addr);
   paddr_t offset = addr - map->low;
+  io_lock();
   host_write(map->space + offset, len, data);
   invoke_callback(map->callback, offset, len, true);
+  io_unlock();
 }
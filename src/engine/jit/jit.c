@@ -0,0 +1,522 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/jit.h>
+#include <memory/vaddr.h>
+#include <memory/host-tlb.h>
+#include <isa-all-instr.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#ifndef __x86_64__
+#error "ENGINE_JIT only supports x86-64 hosts"
+#endif
+
+// The basic blocks on hot paths found by superblock formation are
+// translated. A run of at least JIT_RUN_MIN supported instructions in a
+// basic block becomes a host function, which returns the next Decode to
+// interpret. The first instruction of the run is replaced by exec_jit(),
+// and its EHelper is kept in a header just before the host code.
+//
+// Guest registers are not cached in host registers. Every operand is
+// accessed in memory through its offset to `cpu`, so that the code is
+// always in sync with the interpreter. Loads and stores with address
+// translation look up the host TLB inline, and access host memory directly
+// when it hits. Misses, misaligned accesses and the other loads and stores
+// call helpers, which record the instruction for exceptions.
+#define JIT_RUN_MIN 2
+#define JIT_INSTR_MAX_SIZE 160 // bytes of host code for a guest instruction
+#define JIT_RUN_MAX_SIZE  56  // bytes of alignment, header, prologue and epilogue
+#define JIT_LABEL_HASH_SIZE 4096
+
+typedef struct {
+  const void *EHelper; // of the first instruction
+  uint64_t nr_instr;
+} jit_header_t;
+
+static HART_LOCAL uint8_t *jit_code_pool = NULL;
+static HART_LOCAL int *jit_code_used = NULL;
+static HART_LOCAL size_t jit_chunk_code_size = 0;
+static HART_LOCAL const void *g_exec_jit = NULL;
+static HART_LOCAL struct {
+  const void *label;
+  int id;
+} jit_label[JIT_LABEL_HASH_SIZE];
+
+static HART_LOCAL struct {
+  uint64_t run, instr, bytes;
+} jit_stat = {};
+
+static HART_LOCAL uint8_t *jit_p = NULL; // where to emit host code
+static HART_LOCAL bool jit_fail = false;
+
+// rbx points into `cpu` so that the general purpose registers are in the range of disp8
+#define JIT_BASE ((const uint8_t *)&cpu + 128)
+
+static inline uint64_t jit_label_hash(const void *label) {
+  return (((uintptr_t)label * 0x9e3779b97f4a7c15ull) >> 32) & (JIT_LABEL_HASH_SIZE - 1);
+}
+
+static int jit_exec_id(const void *label) {
+  uint64_t i = jit_label_hash(label);
+  while (jit_label[i].label != NULL) {
+    if (jit_label[i].label == label) return jit_label[i].id;
+    i = (i + 1) & (JIT_LABEL_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
+// x86-64 encoding
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8 };
+#define REX_W 0x48
+
+// "op r/m, r" opcodes and "op r/m, imm32" extensions
+enum { ALU_ADD, ALU_OR, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+static const uint8_t alu_opcode[] = { 0x01, 0x09, 0x21, 0x29, 0x31, 0x39 };
+static const uint8_t alu_ext[] = { 0, 1, 4, 5, 6, 7 };
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+static inline void emit8(uint8_t b) { *jit_p ++ = b; }
+static inline void emit32(uint32_t w) { memcpy(jit_p, &w, 4); jit_p += 4; }
+static inline void emit64(uint64_t w) { memcpy(jit_p, &w, 8); jit_p += 8; }
+
+// ModRM for [rbx + disp]
+static void emit_mem(int reg, const void *p) {
+  intptr_t disp = (const uint8_t *)p - JIT_BASE;
+  if (disp == (int8_t)disp) {
+    emit8(0x40 | (reg & 7) << 3 | RBX);
+    emit8(disp);
+    return;
+  }
+  if (disp != (int32_t)disp) jit_fail = true;
+  emit8(0x80 | (reg & 7) << 3 | RBX);
+  emit32(disp);
+}
+
+// mov reg, [p]
+static void emit_load(int reg, const rtlreg_t *p) {
+  emit8(REX_W); emit8(0x8b); emit_mem(reg, p);
+}
+
+// mov [p], reg
+static void emit_store(const rtlreg_t *p, int reg) {
+  emit8(REX_W); emit8(0x89); emit_mem(reg, p);
+}
+
+// mov reg, imm
+static void emit_li(int reg, uint64_t imm) {
+  if ((int64_t)imm == (int32_t)imm) {
+    emit8(REX_W); emit8(0xc7); emit8(0xc0 | reg); emit32(imm);
+  } else {
+    emit8(REX_W); emit8(0xb8 | reg); emit64(imm);
+  }
+}
+
+// mov reg32, imm32
+static void emit_li32(int reg, uint32_t imm) {
+  if (reg >= R8) emit8(0x41);
+  emit8(0xb8 | (reg & 7)); emit32(imm);
+}
+
+static void emit_alu_rr(int op, int dst, int src, bool w) {
+  if (w) emit8(REX_W);
+  emit8(alu_opcode[op]); emit8(0xc0 | src << 3 | dst);
+}
+
+static void emit_alu_ri(int op, int dst, word_t imm, bool w) {
+  if (w && (sword_t)imm != (int32_t)imm) {
+    emit_li(RCX, imm);
+    emit_alu_rr(op, dst, RCX, w);
+    return;
+  }
+  if (w) emit8(REX_W);
+  emit8(0x81); emit8(0xc0 | alu_ext[op] << 3 | dst); emit32(imm);
+}
+
+static void emit_shift_ri(int ext, int dst, int imm, bool w) {
+  if (w) emit8(REX_W);
+  emit8(0xc1); emit8(0xc0 | ext << 3 | dst); emit8(imm);
+}
+
+// shift by cl
+static void emit_shift_rr(int ext, int dst, bool w) {
+  if (w) emit8(REX_W);
+  emit8(0xd3); emit8(0xc0 | ext << 3 | dst);
+}
+
+// movsxd reg, reg32
+static void emit_sext32(int reg) {
+  emit8(REX_W); emit8(0x63); emit8(0xc0 | reg << 3 | reg);
+}
+
+static void emit_call(const void *fn) {
+  emit_li(RAX, (uintptr_t)fn);
+  emit8(0xff); emit8(0xd0);
+}
+
+// jcc/jmp rel8 to a label bound later by emit_bind()
+static uint8_t *emit_jump(uint8_t opcode) {
+  emit8(opcode); emit8(0);
+  return jit_p;
+}
+
+static void emit_bind(uint8_t *jump) {
+  intptr_t rel = jit_p - jump;
+  if (rel != (int8_t)rel) jit_fail = true;
+  jump[-1] = rel;
+}
+
+// translation of guest instructions
+
+static word_t jit_load_helper(Decode *s, vaddr_t addr, int len, int mmu_mode) {
+  save_globals(s);
+  return vaddr_read(s, addr, len, mmu_mode);
+}
+
+static void jit_store_helper(Decode *s, vaddr_t addr, int len, word_t data, int mmu_mode) {
+  save_globals(s);
+  vaddr_write(s, addr, len, data, mmu_mode);
+}
+
+static void jit_alu(int op, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src2, bool w) {
+  emit_load(RAX, src1);
+  emit_load(RCX, src2);
+  emit_alu_rr(op, RAX, RCX, w);
+  if (!w) emit_sext32(RAX);
+  emit_store(dest, RAX);
+}
+
+static void jit_alui(int op, rtlreg_t *dest, const rtlreg_t *src1, word_t imm, bool w) {
+  emit_load(RAX, src1);
+  emit_alu_ri(op, RAX, imm, w);
+  if (!w) emit_sext32(RAX);
+  emit_store(dest, RAX);
+}
+
+static void jit_shift(int ext, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src2, bool w) {
+  emit_load(RAX, src1);
+  emit_load(RCX, src2);
+  emit_shift_rr(ext, RAX, w); // the count is masked as in RISC-V
+  if (!w) emit_sext32(RAX);
+  emit_store(dest, RAX);
+}
+
+static void jit_shifti(int ext, rtlreg_t *dest, const rtlreg_t *src1, word_t imm, bool w) {
+  emit_load(RAX, src1);
+  emit_shift_ri(ext, RAX, imm & (w ? 0x3f : 0x1f), w);
+  if (!w) emit_sext32(RAX);
+  emit_store(dest, RAX);
+}
+
+static void jit_setrelop(bool is_unsigned, rtlreg_t *dest, const rtlreg_t *src1,
+    const rtlreg_t *src2, word_t imm) {
+  emit_load(RAX, src1);
+  if (src2 != NULL) {
+    emit_load(RCX, src2);
+    emit_alu_rr(ALU_CMP, RAX, RCX, true);
+  } else {
+    emit_alu_ri(ALU_CMP, RAX, imm, true);
+  }
+  emit8(0x0f); emit8(is_unsigned ? 0x92 : 0x9c); emit8(0xc0); // setb/setl al
+  emit8(0x0f); emit8(0xb6); emit8(0xc0);                       // movzx eax, al
+  emit_store(dest, RAX);
+}
+
+static void jit_mul(rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src2, bool w) {
+  emit_load(RAX, src1);
+  emit_load(RCX, src2);
+  emit8(REX_W); emit8(0x0f); emit8(0xaf); emit8(0xc1); // imul rax, rcx
+  if (!w) emit_sext32(RAX);
+  emit_store(dest, RAX);
+}
+
+static void jit_li(rtlreg_t *dest, word_t imm) {
+  emit_li(RAX, imm);
+  emit_store(dest, RAX);
+}
+
+// Look up the host TLB with the guest virtual address in rsi as
+// hosttlb_read() does, and leave the host address in rax when it hits.
+// The jumps taken on a miss are put into miss[], return false if the host
+// TLB is out of the reach of rbx.
+static bool jit_hosttlb_lookup(bool is_store, int len, uint8_t *miss[2]) {
+  HostTLBJitInfo tlb;
+  hosttlb_jit_info(&tlb);
+  const uint8_t *table = is_store ? tlb.wtlb : tlb.rtlb;
+  intptr_t reach[] = { table - JIT_BASE, table + tlb.size * 16 - JIT_BASE,
+    (const uint8_t *)tlb.ctx - JIT_BASE, (const uint8_t *)tlb.ctx_set - JIT_BASE };
+  for (int i = 0; i < ARRLEN(reach); i ++) {
+    if (reach[i] != (int32_t)reach[i]) return false;
+  }
+
+  miss[0] = NULL;
+  if (len > 1) {
+    // a misaligned access may cross the page or raise an exception
+    emit8(0x40); emit8(0xf6); emit8(0xc6); emit8(len - 1); // test sil, len - 1
+    miss[0] = emit_jump(0x75);                            // jnz
+  }
+  emit8(REX_W); emit8(0x89); emit8(0xf0);                 // mov rax, rsi
+  emit_shift_ri(SHIFT_SHR, RAX, PAGE_SHIFT, true);        // vpn
+  emit_load(RCX, tlb.ctx_set);
+  emit_alu_rr(ALU_XOR, RCX, RAX, true);
+  emit_alu_ri(ALU_AND, RCX, tlb.size - 1, false);         // index
+  emit_shift_ri(SHIFT_SHL, RCX, 4, true);
+  emit8(REX_W); emit8(0x0b); emit_mem(RAX, tlb.ctx);      // or rax, [ctx], the tag
+  emit8(REX_W); emit8(0x8d); emit8(0x8c); emit8(0x0b);    // lea rcx, [rbx + rcx + table]
+  emit32(table - JIT_BASE);
+  emit8(REX_W); emit8(0x3b); emit8(0x41); emit8(8);       // cmp rax, [rcx + 8]
+  miss[1] = emit_jump(0x75);                              // jne
+  emit8(REX_W); emit8(0x8b); emit8(0x01);                 // mov rax, [rcx]
+  emit_alu_rr(ALU_ADD, RAX, RSI, true);
+  return true;
+}
+
+// load from or store to the host address in rax
+static void jit_host_access(bool is_store, int len, bool is_signed) {
+  if (is_store) {
+    switch (len) {
+      case 8: emit8(REX_W); emit8(0x89); emit8(0x10); break;  // mov [rax], rdx
+      case 4: emit8(0x89); emit8(0x10); break;                // mov [rax], edx
+      case 2: emit8(0x66); emit8(0x89); emit8(0x10); break;   // mov [rax], dx
+      case 1: emit8(0x88); emit8(0x10); break;                // mov [rax], dl
+    }
+    return;
+  }
+  switch (len) {
+    case 8: emit8(REX_W); emit8(0x8b); emit8(0x00); break;    // mov rax, [rax]
+    case 4: if (is_signed) { emit8(REX_W); emit8(0x63); }     // movsxd rax, dword [rax]
+            else emit8(0x8b);                                 // mov eax, [rax]
+            emit8(0x00); break;
+    case 2: if (is_signed) emit8(REX_W);
+            emit8(0x0f); emit8(is_signed ? 0xbf : 0xb7); emit8(0x00); break; // movsx rax/movzx eax, word [rax]
+    case 1: if (is_signed) emit8(REX_W);
+            emit8(0x0f); emit8(is_signed ? 0xbe : 0xb6); emit8(0x00); break; // movsx rax/movzx eax, byte [rax]
+  }
+}
+
+static void jit_ldst(Decode *s, bool is_store, int len, bool is_signed, int mmu_mode) {
+  emit_load(RSI, dsrc1);
+  if (id_src2->imm != 0) emit_alu_ri(ALU_ADD, RSI, id_src2->imm, true);
+  uint8_t *miss[2], *done = NULL;
+  if (mmu_mode == MMU_TRANSLATE && jit_hosttlb_lookup(is_store, len, miss)) {
+    if (is_store) emit_load(RDX, ddest);
+    jit_host_access(is_store, len, is_signed);
+    done = emit_jump(0xeb);                               // jmp
+    if (miss[0] != NULL) emit_bind(miss[0]);
+    emit_bind(miss[1]);
+  }
+
+  emit_li(RDI, (uintptr_t)s);
+  emit_li32(RDX, len);
+  if (is_store) {
+    emit_load(RCX, ddest);
+    emit_li32(R8, mmu_mode);
+    emit_call(jit_store_helper);
+    if (done != NULL) emit_bind(done);
+    return;
+  }
+  emit_li32(RCX, mmu_mode);
+  emit_call(jit_load_helper);
+  if (is_signed) {
+    switch (len) {
+      case 4: emit_sext32(RAX); break;
+      case 2: emit8(REX_W); emit8(0x0f); emit8(0xbf); emit8(0xc0); break; // movsx rax, ax
+      case 1: emit8(REX_W); emit8(0x0f); emit8(0xbe); emit8(0xc0); break; // movsx rax, al
+    }
+  }
+  if (done != NULL) emit_bind(done);
+  emit_store(ddest, RAX);
+}
+
+#define def_jit_ldst(name, is_store, len, is_signed) \
+  case concat(EXEC_ID_, name): jit_ldst(s, is_store, len, is_signed, MMU_DIRECT); break; \
+  case concat3(EXEC_ID_, name, _mmu): jit_ldst(s, is_store, len, is_signed, MMU_TRANSLATE); break;
+
+// return false if the instruction is not supported
+static bool jit_instr(Decode *s) {
+  if (s->type != INSTR_TYPE_N) return false;
+  switch (jit_exec_id(s->EHelper)) {
+    case EXEC_ID_add:   jit_alu(ALU_ADD, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_sub:   jit_alu(ALU_SUB, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_and:   jit_alu(ALU_AND, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_or:    jit_alu(ALU_OR,  ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_xor:   jit_alu(ALU_XOR, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_addw:  jit_alu(ALU_ADD, ddest, dsrc1, dsrc2, false); break;
+    case EXEC_ID_subw:  jit_alu(ALU_SUB, ddest, dsrc1, dsrc2, false); break;
+    case EXEC_ID_sll:   jit_shift(SHIFT_SHL, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_srl:   jit_shift(SHIFT_SHR, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_sra:   jit_shift(SHIFT_SAR, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_sllw:  jit_shift(SHIFT_SHL, ddest, dsrc1, dsrc2, false); break;
+    case EXEC_ID_srlw:  jit_shift(SHIFT_SHR, ddest, dsrc1, dsrc2, false); break;
+    case EXEC_ID_sraw:  jit_shift(SHIFT_SAR, ddest, dsrc1, dsrc2, false); break;
+    case EXEC_ID_slt:   jit_setrelop(false, ddest, dsrc1, dsrc2, 0); break;
+    case EXEC_ID_sltu:  jit_setrelop(true,  ddest, dsrc1, dsrc2, 0); break;
+    case EXEC_ID_mul:   jit_mul(ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_mulw:  jit_mul(ddest, dsrc1, dsrc2, false); break;
+
+    case EXEC_ID_addi:  jit_alui(ALU_ADD, ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_andi:  jit_alui(ALU_AND, ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_ori:   jit_alui(ALU_OR,  ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_xori:  jit_alui(ALU_XOR, ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_addiw: jit_alui(ALU_ADD, ddest, dsrc1, id_src2->imm, false); break;
+    case EXEC_ID_slli:  jit_shifti(SHIFT_SHL, ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_srli:  jit_shifti(SHIFT_SHR, ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_srai:  jit_shifti(SHIFT_SAR, ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_slliw: jit_shifti(SHIFT_SHL, ddest, dsrc1, id_src2->imm, false); break;
+    case EXEC_ID_srliw: jit_shifti(SHIFT_SHR, ddest, dsrc1, id_src2->imm, false); break;
+    case EXEC_ID_sraiw: jit_shifti(SHIFT_SAR, ddest, dsrc1, id_src2->imm, false); break;
+    case EXEC_ID_slti:  jit_setrelop(false, ddest, dsrc1, NULL, id_src2->imm); break;
+    case EXEC_ID_sltui: jit_setrelop(true,  ddest, dsrc1, NULL, id_src2->imm); break;
+    case EXEC_ID_lui:   jit_li(ddest, id_src1->imm); break;
+    case EXEC_ID_auipc: jit_li(ddest, id_src1->imm); break;
+
+    case EXEC_ID_c_li:    jit_li(ddest, id_src2->imm); break;
+    case EXEC_ID_c_mv:    jit_alui(ALU_ADD, ddest, dsrc1, 0, true); break;
+    case EXEC_ID_c_addi:  jit_alui(ALU_ADD, ddest, ddest, id_src2->imm, true); break;
+    case EXEC_ID_c_addiw: jit_alui(ALU_ADD, ddest, ddest, id_src2->imm, false); break;
+    case EXEC_ID_c_andi:  jit_alui(ALU_AND, ddest, ddest, id_src2->imm, true); break;
+    case EXEC_ID_c_slli:  jit_shifti(SHIFT_SHL, ddest, ddest, id_src2->imm, true); break;
+    case EXEC_ID_c_srli:  jit_shifti(SHIFT_SHR, ddest, ddest, id_src2->imm, true); break;
+    case EXEC_ID_c_srai:  jit_shifti(SHIFT_SAR, ddest, ddest, id_src2->imm, true); break;
+    case EXEC_ID_c_add:   jit_alu(ALU_ADD, ddest, ddest, dsrc2, true); break;
+    case EXEC_ID_c_sub:   jit_alu(ALU_SUB, ddest, ddest, dsrc2, true); break;
+    case EXEC_ID_c_and:   jit_alu(ALU_AND, ddest, ddest, dsrc2, true); break;
+    case EXEC_ID_c_or:    jit_alu(ALU_OR,  ddest, ddest, dsrc2, true); break;
+    case EXEC_ID_c_xor:   jit_alu(ALU_XOR, ddest, ddest, dsrc2, true); break;
+    case EXEC_ID_c_addw:  jit_alu(ALU_ADD, ddest, ddest, dsrc2, false); break;
+    case EXEC_ID_c_subw:  jit_alu(ALU_SUB, ddest, ddest, dsrc2, false); break;
+
+    case EXEC_ID_p_li_0:   jit_li(ddest, 0); break;
+    case EXEC_ID_p_li_1:   jit_li(ddest, 1); break;
+    case EXEC_ID_p_inc:    jit_alui(ALU_ADD, ddest, ddest, 1, true); break;
+    case EXEC_ID_p_dec:    jit_alui(ALU_SUB, ddest, ddest, 1, true); break;
+    case EXEC_ID_p_sext_w: jit_alui(ALU_ADD, ddest, dsrc1, 0, false); break;
+    // the generic operands are still decoded, and x0 reads from cpu.gpr[0]
+    case EXEC_ID_p_nop:    break;
+    case EXEC_ID_p_not:    jit_alui(ALU_XOR, ddest, dsrc1, -1, true); break;
+    case EXEC_ID_p_neg:    jit_alu(ALU_SUB, ddest, dsrc1, dsrc2, true); break;
+    case EXEC_ID_p_negw:   jit_alu(ALU_SUB, ddest, dsrc1, dsrc2, false); break;
+    case EXEC_ID_p_seqz:   jit_setrelop(true,  ddest, dsrc1, NULL, 1); break;
+    case EXEC_ID_p_snez:   jit_setrelop(true,  ddest, dsrc1, dsrc2, 0); break;
+    case EXEC_ID_p_sltz:   jit_setrelop(false, ddest, dsrc1, NULL, 0); break;
+    case EXEC_ID_p_sgtz:   jit_setrelop(false, ddest, dsrc1, dsrc2, 0); break;
+
+#ifdef CONFIG_TCACHE_FUSION
+    // only the first instruction of a macro-op, the second one is translated next
+    case EXEC_ID_f_lui_addi:     case EXEC_ID_f_lui_addiw:
+    case EXEC_ID_f_auipc_jalr:   case EXEC_ID_f_auipc_ld: case EXEC_ID_f_auipc_ld_mmu:
+      jit_li(ddest, id_src1->imm); break;
+    case EXEC_ID_f_slli_srli:    jit_shifti(SHIFT_SHL, ddest, dsrc1, id_src2->imm, true); break;
+    case EXEC_ID_f_add_ld:       case EXEC_ID_f_add_ld_mmu:
+      jit_alu(ALU_ADD, ddest, dsrc1, dsrc2, true); break;
+#endif
+
+    def_jit_ldst(ld,  false, 8, true)
+    def_jit_ldst(lw,  false, 4, true)
+    def_jit_ldst(lh,  false, 2, true)
+    def_jit_ldst(lb,  false, 1, true)
+    def_jit_ldst(lwu, false, 4, false)
+    def_jit_ldst(lhu, false, 2, false)
+    def_jit_ldst(lbu, false, 1, false)
+    def_jit_ldst(sd,  true,  8, false)
+    def_jit_ldst(sw,  true,  4, false)
+    def_jit_ldst(sh,  true,  2, false)
+    def_jit_ldst(sb,  true,  1, false)
+    default: return false;
+  }
+  return !jit_fail;
+}
+
+void jit_translate(int chunk, Decode *start, Decode *end) {
+  uint8_t *area = jit_code_pool + chunk * jit_chunk_code_size;
+  Decode *s = start;
+  while (s < end) {
+    if (s->EHelper == g_exec_jit) { // already translated
+      s += ((jit_header_t *)s->jit_code - 1)->nr_instr;
+      continue;
+    }
+
+    jit_header_t *header = (void *)(area + ((jit_code_used[chunk] + 15) & ~15));
+    uint8_t *code = (uint8_t *)(header + 1);
+    jit_p = code;
+    emit8(0x53);                         // push rbx
+    emit8(REX_W); emit8(0xbb); emit64((uintptr_t)JIT_BASE); // mov rbx, JIT_BASE
+
+    Decode *run = s;
+    while (s < end) {
+      uint8_t *p = jit_p;
+      jit_fail = false;
+      if (!jit_instr(s)) { jit_p = p; break; }
+      s ++;
+    }
+
+    int nr_instr = s - run;
+    if (nr_instr >= JIT_RUN_MIN) {
+      emit_li(RAX, (uintptr_t)s);       // the next Decode to interpret
+      emit8(0x5b);                      // pop rbx
+      emit8(0xc3);                      // ret
+      Assert(jit_p - area <= jit_chunk_code_size, "JIT code buffer overflow");
+      header->EHelper = run->EHelper;
+      header->nr_instr = nr_instr;
+      run->jit_code = code;
+      run->EHelper = g_exec_jit;
+      jit_code_used[chunk] = jit_p - area;
+      jit_stat.run ++;
+      jit_stat.instr += nr_instr;
+      jit_stat.bytes += jit_p - (uint8_t *)header;
+    }
+    if (nr_instr == 0) s ++;
+  }
+}
+
+void jit_restore(Decode *s) {
+  if (s->EHelper == g_exec_jit) s->EHelper = ((jit_header_t *)s->jit_code - 1)->EHelper;
+}
+
+void jit_chunk_reset(int chunk) {
+  jit_code_used[chunk] = 0;
+}
+
+void jit_statistic() {
+  Log("jit: %'lu runs, %'lu instructions translated into %'lu bytes",
+      jit_stat.run, jit_stat.instr, jit_stat.bytes);
+}
+
+void jit_code_init(int nr_chunk, int chunk_size) {
+  jit_chunk_code_size = chunk_size * (JIT_INSTR_MAX_SIZE + JIT_RUN_MAX_SIZE);
+  size_t size = nr_chunk * jit_chunk_code_size;
+  // only reserve the address space, host pages are committed on first use
+  jit_code_pool = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(jit_code_pool != MAP_FAILED, "failed to reserve %zu bytes for JIT code", size);
+  jit_code_used = calloc(nr_chunk, sizeof(int));
+  assert(jit_code_used);
+}
+
+void jit_init(const void **exec_table, const void *exec_jit) {
+  int i;
+  assert(TOTAL_INSTR * 2 <= JIT_LABEL_HASH_SIZE);
+  for (i = 0; i < TOTAL_INSTR; i ++) {
+    uint64_t h = jit_label_hash(exec_table[i]);
+    while (jit_label[h].label != NULL) h = (h + 1) & (JIT_LABEL_HASH_SIZE - 1);
+    jit_label[h].label = exec_table[i];
+    jit_label[h].id = i;
+  }
+  g_exec_jit = exec_jit;
+}
@@ -126,4 +126,6 @@ paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
 
 bool isa_pmp_check_permission(paddr_t paddr, int len, int type, int mode) {
   return true; // TODO: complete it
-}
\ No newline at end of file
+}
+void isa_mmu_statistic() {
+}
@@ -18,8 +18,11 @@
 #include <device/map.h>
 #include "local-include/csr.h"
 
+#define CLINT_MSIP     (0x0000 / sizeof(uint32_t))
 #define CLINT_MTIMECMP (0x4000 / sizeof(clint_base[0]))
 #define CLINT_MTIME    (0xBFF8 / sizeof(clint_base[0]))
+// every hart has its own msip and mtimecmp, and they are updated by the hart
+#define CLINT_HART     MUXDEF(CONFIG_MULTI_HART, mhartid->val, 0)
 #define TIMEBASE 1000000ul
 #define US_PERCYCLE (1000000 / TIMEBASE)
 
@@ -27,7 +30,7 @@ static uint64_t *clint_base = NULL;
 static uint64_t boot_time = 0;
 uint64_t clint_snapshot, spec_clint_snapshot;
 
-extern uint64_t g_nr_guest_instr;
+extern HART_LOCAL uint64_t g_nr_guest_instr;
 extern uint64_t stable_log_begin, spec_log_begin;
 
 void clint_take_snapshot() {
@@ -52,7 +55,8 @@ void update_clint() {
   uint64_t uptime = get_time();
   clint_base[CLINT_MTIME] = uptime / US_PERCYCLE;
 #endif
-  mip->mtip = (clint_base[CLINT_MTIME] >= clint_base[CLINT_MTIMECMP]);
+  mip->mtip = (clint_base[CLINT_MTIME] >= clint_base[CLINT_MTIMECMP + CLINT_HART]);
+  IFDEF(CONFIG_MULTI_HART, mip->msip = ((uint32_t *)clint_base)[CLINT_MSIP + CLINT_HART] & 1);
 }
 
 uint64_t clint_uptime() {
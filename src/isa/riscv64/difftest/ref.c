@@ -149,7 +149,7 @@ void csr_writeback() {
 extern uint64_t stable_log_begin, spec_log_begin;
 
 extern struct lightqs_reg_ss reg_ss;
-extern uint64_t g_nr_guest_instr;
+extern HART_LOCAL uint64_t g_nr_guest_instr;
 void isa_difftest_regcpy(void *dut, bool direction, bool restore, uint64_t restore_count) {
   if (restore) {
     uint64_t left_exec = lightqs_restore_reg_snapshot(restore_count);
@@ -200,6 +200,16 @@ void isa_difftest_regcpy(void *dut, bool direction) {
 void isa_difftest_csrcpy(void *dut, bool direction) {
   if (direction == DIFFTEST_TO_REF) {
     memcpy(csr_array, dut, 4096 * sizeof(rtlreg_t));
+    // mstatus and satp may be changed
+    extern void update_mmu_state();
+    extern void pwc_flush();
+    update_mmu_state();
+    pwc_flush();
+#ifdef CONFIG_RV_PMP_CHECK
+    // the PMP CSRs may be changed
+    extern void pmp_cache_flush();
+    pmp_cache_flush();
+#endif
   } else {
     memcpy(dut, csr_array, 4096 * sizeof(rtlreg_t));
   }
@@ -174,6 +174,14 @@
 #define ZICOND_INSTR_TERNARY(f)
 #endif // CONFIG_RVZICOND
 
+#ifdef CONFIG_TCACHE_FUSION
+#define FUSION_INSTR_TERNARY(f) \
+  f(f_lui_addi) f(f_lui_addiw) f(f_auipc_jalr) f(f_auipc_ld) f(f_auipc_ld_mmu) \
+  f(f_slli_srli) f(f_add_ld) f(f_add_ld_mmu)
+#else // CONFIG_TCACHE_FUSION
+#define FUSION_INSTR_TERNARY(f)
+#endif // CONFIG_TCACHE_FUSION
+
 #ifdef CONFIG_FPU_NONE
 #define FLOAT_INSTR_BINARY(f)
 #define FLOAT_INSTR_TERNARY(f)
@@ -202,7 +210,7 @@
   f(inv) f(rt_inv) f(nemu_trap) \
   f(fence_i) f(fence) \
   SYS_INSTR_NULLARY(f) \
-  f(p_ret)
+  f(p_ret) f(p_nop)
 
 #define INSTR_UNARY(f) \
   f(p_li_0) f(p_li_1)
@@ -212,6 +220,7 @@
   f(ld) f(lw) f(lh) f(lb) f(lwu) f(lhu) f(lbu) f(sd) f(sw) f(sh) f(sb) \
   f(c_j) f(p_jal) f(c_jr) f(c_jalr) \
   f(c_beqz) f(c_bnez) f(c_mv) f(p_sext_w) \
+  f(p_not) f(p_neg) f(p_negw) f(p_seqz) f(p_snez) f(p_sltz) f(p_sgtz) \
   BITMANIP_INSTR_BINARY(f) \
   CRYPTO_INSTR_BINARY(f) \
   AMO_INSTR_BINARY(f) \
@@ -238,6 +247,7 @@
   BITMANIP_INSTR_TERNARY(f) \
   CRYPTO_INSTR_TERNARY(f) \
   ZICOND_INSTR_TERNARY(f) \
+  FUSION_INSTR_TERNARY(f) \
   VECTOR_INSTR_TERNARY(f)
 
 def_all_EXEC_ID();
@@ -121,6 +121,9 @@ typedef struct {
   // for LR/SC
   uint64_t lr_addr;
   uint64_t lr_valid;
+#ifdef CONFIG_MULTI_HART
+  uint64_t lr_val; // SC succeeds only if the memory still holds it
+#endif
 
   bool INTR;
 
@@ -36,4 +36,7 @@
 #ifdef CONFIG_RVZICOND
 #include "../instr/rvzicond/exec.h"
 #endif
+#ifdef CONFIG_TCACHE_FUSION
+#include "../instr/fusion/exec.h"
+#endif
 #include "../instr/special.h"
@@ -38,14 +38,8 @@ void init_clint();
 #endif
 void init_device();
 
-void init_isa() {
-  // NEMU has some cached states and some static variables in the source code.
-  // They are assumed to have initialized states every time when the dynamic lib is loaded.
-  // However, if we link NEMU as a static library, we have to manually initialize them.
-  static bool is_second_call = false;
-  if (is_second_call) {
-    memset(csr_array, 0, sizeof(csr_array));
-  }
+// reset the architectural state of the hart
+static void reset_hart() {
   init_csr();
 
 #ifndef CONFIG_RESET_FROM_MMIO
@@ -111,6 +105,17 @@ void init_isa() {
 #ifdef CONFIG_RVSDTRIG
   init_trigger();
 #endif // CONFIG_RVSDTRIG
+}
+
+void init_isa() {
+  // NEMU has some cached states and some static variables in the source code.
+  // They are assumed to have initialized states every time when the dynamic lib is loaded.
+  // However, if we link NEMU as a static library, we have to manually initialize them.
+  static bool is_second_call = false;
+  if (is_second_call) {
+    memset(csr_array, 0, sizeof(csr_array));
+  }
+  reset_hart();
 
 #ifndef CONFIG_SHARE
   extern char *cpt_file;
@@ -140,3 +145,12 @@ void init_isa() {
 
   is_second_call = true;
 }
+
+#ifdef CONFIG_MULTI_HART
+// called on the host thread of every hart other than hart 0
+void init_isa_hart(int hartid) {
+  reset_hart();
+  mhartid->val = hartid;
+  csr_prepare();
+}
+#endif
@@ -48,6 +48,9 @@ static inline uint32_t get_instr(Decode *s) {
 #ifdef CONFIG_RVV
 #include "rvv/decode.h"
 #endif // CONFIG_RVV
+#ifdef CONFIG_TCACHE_FUSION
+#include "fusion/decode.h"
+#endif // CONFIG_TCACHE_FUSION
 
 def_THelper(main) {
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 00000 ??", I     , load);
@@ -56,7 +59,7 @@ def_THelper(main) {
 #endif // CONFIG_FPU_NONE
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 00011 ??", I     , mem_fence);
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 00100 ??", I     , op_imm);
-  def_INSTR_IDTAB("??????? ????? ????? ??? ????? 00101 ??", auipc , auipc);
+  def_INSTR_IDTAB("??????? ????? ????? ??? ????? 00101 ??", auipc , auipc_dispatch);
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 00110 ??", I     , op_imm32);
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 01000 ??", S     , store);
 #ifndef CONFIG_FPU_NONE
@@ -65,7 +68,7 @@ def_THelper(main) {
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 01011 ??", R     , atomic);
   def_INSTR_IDTAB("0000001 ????? ????? ??? ????? 01100 ??", R     , rvm);
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 01100 ??", R     , op);
-  def_INSTR_IDTAB("??????? ????? ????? ??? ????? 01101 ??", U     , lui);
+  def_INSTR_IDTAB("??????? ????? ????? ??? ????? 01101 ??", U     , lui_dispatch);
   def_INSTR_IDTAB("0000001 ????? ????? ??? ????? 01110 ??", R     , rvm32);
   def_INSTR_IDTAB("??????? ????? ????? ??? ????? 01110 ??", R     , op32);
 #ifndef CONFIG_FPU_NONE
@@ -123,8 +126,10 @@ int isa_fetch_decode(Decode *s) {
 #endif
 
   s->type = INSTR_TYPE_N;
+  s->ras_hint = RAS_HINT_NONE;
   switch (idx) {
     case EXEC_ID_c_j: case EXEC_ID_p_jal: case EXEC_ID_jal:
+      if (idx == EXEC_ID_p_jal) s->ras_hint = RAS_HINT_PUSH;
       s->jnpc = id_src1->imm; s->type = INSTR_TYPE_J; break;
 
     case EXEC_ID_beq: case EXEC_ID_bne: case EXEC_ID_blt: case EXEC_ID_bge:
@@ -135,6 +140,10 @@ int isa_fetch_decode(Decode *s) {
 
     case EXEC_ID_p_ret: case EXEC_ID_c_jr: case EXEC_ID_c_jalr: case EXEC_ID_jalr:
     case EXEC_ID_c_ebreak:
+      if (idx == EXEC_ID_p_ret) s->ras_hint = RAS_HINT_POP;
+      // jalr and c.jalr with ra as the link register are calls
+      else if ((idx == EXEC_ID_jalr || idx == EXEC_ID_c_jalr) &&
+          id_dest->preg == &reg_l(1)) s->ras_hint = RAS_HINT_PUSH;
 #if defined(CONFIG_DEBUG) || defined(CONFIG_SHARE)
     case EXEC_ID_mret: case EXEC_ID_sret: case EXEC_ID_ecall: case EXEC_ID_ebreak:
 #endif
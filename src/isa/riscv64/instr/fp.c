@@ -19,7 +19,7 @@
 #include <rtl/fp.h>
 #include <cpu/cpu.h>
 
-static uint32_t nemu_rm_cache = 0;
+static HART_LOCAL uint32_t nemu_rm_cache = 0;
 void fp_update_rm_cache(uint32_t rm) {
   switch (rm) {
     case 0: nemu_rm_cache = FPCALL_RM_RNE; return;
@@ -0,0 +1,72 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+
+// The tables below are indexed by the second instruction of a pair, whose
+// rs1 is the rd of the first instruction. The pairs computing a value in two
+// steps are fused only if the second instruction overwrites the first result.
+
+def_THelper(fuse_lui) {
+  if (s->isa.instr.i.rd != s->isa.instr.i.rs1) return EXEC_ID_inv;
+  def_INSTR_TAB("??????? ????? ????? 000 ????? 00100 11", f_lui_addi);
+  def_INSTR_TAB("??????? ????? ????? 000 ????? 00110 11", f_lui_addiw);
+  return EXEC_ID_inv;
+}
+
+def_THelper(fuse_auipc) {
+  def_INSTR_TAB("??????? ????? ????? 000 ????? 11001 11", f_auipc_jalr);
+  int mmu_mode = isa_mmu_state();
+  if (mmu_mode == MMU_DIRECT) {
+    def_INSTR_TAB("??????? ????? ????? 011 ????? 00000 11", f_auipc_ld);
+  } else if (mmu_mode == MMU_TRANSLATE) {
+    def_INSTR_TAB("??????? ????? ????? 011 ????? 00000 11", f_auipc_ld_mmu);
+  } else { assert(0); }
+  return EXEC_ID_inv;
+}
+
+def_THelper(fuse_slli) {
+  if (s->isa.instr.i.rd != s->isa.instr.i.rs1) return EXEC_ID_inv;
+  def_INSTR_TAB("000000? ????? ????? 101 ????? 00100 11", f_slli_srli);
+  return EXEC_ID_inv;
+}
+
+def_THelper(fuse_add) {
+  int mmu_mode = isa_mmu_state();
+  if (mmu_mode == MMU_DIRECT) {
+    def_INSTR_TAB("??????? ????? ????? 011 ????? 00000 11", f_add_ld);
+  } else if (mmu_mode == MMU_TRANSLATE) {
+    def_INSTR_TAB("??????? ????? ????? 011 ????? 00000 11", f_add_ld_mmu);
+  } else { assert(0); }
+  return EXEC_ID_inv;
+}
+
+static inline int table_fuse(Decode *s, Decode *second) {
+  def_INSTR_raw("??????? ????? ????? ??? ????? 01101 11", return table_fuse_lui(second));
+  def_INSTR_raw("??????? ????? ????? ??? ????? 00101 11", return table_fuse_auipc(second));
+  def_INSTR_raw("000000? ????? ????? 001 ????? 00100 11", return table_fuse_slli(second));
+  def_INSTR_raw("0000000 ????? ????? 000 ????? 01100 11", return table_fuse_add(second));
+  return EXEC_ID_inv;
+}
+
+// return the exec ID of the macro-op running `prev` and the next
+// instruction `s`, or EXEC_ID_inv if they can not be fused
+int isa_fuse(Decode *prev, Decode *s) {
+  // RVC instructions are not fused
+  if (prev->isa.instr.r.opcode1_0 != 0x3 || s->isa.instr.r.opcode1_0 != 0x3) return EXEC_ID_inv;
+  uint32_t rd = prev->isa.instr.r.rd;
+  if (rd == 0 || s->isa.instr.r.rs1 != rd) return EXEC_ID_inv;
+  return table_fuse(prev, s);
+}
@@ -0,0 +1,70 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+
+// Macro-ops of the instruction pairs fused by tcache, see isa_fuse().
+// A macro-op runs at the entry of the first instruction, and moves to the
+// entry of the second instruction to read its operands. Both entries keep
+// their idx_in_bb, and the second one is the current instruction for the
+// exceptions and control transfers.
+
+// lui rd, hi; addi rd, rd, lo
+def_EHelper(f_lui_addi) {
+  word_t hi = id_src1->imm;
+  s ++;
+  rtl_li(s, ddest, hi + id_src2->imm);
+}
+
+// lui rd, hi; addiw rd, rd, lo
+def_EHelper(f_lui_addiw) {
+  word_t hi = id_src1->imm;
+  s ++;
+  rtl_li(s, ddest, (sword_t)(int32_t)(hi + id_src2->imm));
+}
+
+// slli rd, rs, a; srli rd, rd, b
+def_EHelper(f_slli_srli) {
+  rtl_shli(s, s0, dsrc1, id_src2->imm);
+  s ++;
+  rtl_shri(s, ddest, s0, id_src2->imm);
+}
+
+// auipc rt, hi; jalr rd, lo(rt)
+def_EHelper(f_auipc_jalr) {
+  rtl_li(s, ddest, id_src1->imm);
+  s ++;
+  save_globals(s);
+  rtl_addi(s, s0, dsrc1, id_src2->imm);
+  rtl_andi(s, s0, s0, ~1UL);
+  rtl_li(s, ddest, s->snpc);
+  rtl_jr(s, s0);
+}
+
+#define def_fused_ld_template(name, first, mmu_mode) \
+  def_EHelper(name) { \
+    first; \
+    s ++; \
+    save_globals(s); \
+    rtl_lms(s, ddest, dsrc1, id_src2->imm, 8, mmu_mode); \
+  }
+
+// auipc rt, hi; ld rd, lo(rt)
+def_fused_ld_template(f_auipc_ld, rtl_li(s, ddest, id_src1->imm), MMU_DIRECT)
+def_fused_ld_template(f_auipc_ld_mmu, rtl_li(s, ddest, id_src1->imm), MMU_TRANSLATE)
+
+// add rt, rs1, rs2; ld rd, imm(rt)
+def_fused_ld_template(f_add_ld, rtl_add(s, ddest, dsrc1, dsrc2), MMU_DIRECT)
+def_fused_ld_template(f_add_ld_mmu, rtl_add(s, ddest, dsrc1, dsrc2), MMU_TRANSLATE)
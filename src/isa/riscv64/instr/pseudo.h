@@ -18,8 +18,6 @@
 //
 // The following pseudo instructions are excluded
 // (1) seem not frequently present during execution
-//       nop    not    neg    negw
-//       seqz   snez   sltz   sgtz
 //       [[all CSR instructions]]
 // (2) only expansion without optimization
 //       la
@@ -38,10 +36,41 @@
 //       beqz   bnez
 //       li     mv
 #include <generated/autoconf.h>
+def_EHelper(p_nop) {
+}
+
+def_EHelper(p_not) {
+  rtl_not(s, ddest, dsrc1);
+}
+
+def_EHelper(p_neg) {
+  rtl_neg(s, ddest, dsrc2);
+}
+
+def_EHelper(p_negw) {
+  rtl_subw(s, ddest, rz, dsrc2);
+}
+
 def_EHelper(p_sext_w) {
   rtl_addiw(s, ddest, dsrc1, 0);
 }
 
+def_EHelper(p_seqz) {
+  rtl_setrelopi(s, RELOP_EQ, ddest, dsrc1, 0);
+}
+
+def_EHelper(p_snez) {
+  rtl_setrelopi(s, RELOP_NE, ddest, dsrc2, 0);
+}
+
+def_EHelper(p_sltz) {
+  rtl_setrelopi(s, RELOP_LT, ddest, dsrc1, 0);
+}
+
+def_EHelper(p_sgtz) {
+  rtl_setrelopi(s, RELOP_GT, ddest, dsrc2, 0);
+}
+
 def_EHelper(p_blez) {
   rtl_jrelop(s, RELOP_GE, rz, dsrc2, id_dest->imm);
 }
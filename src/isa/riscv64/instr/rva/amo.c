@@ -19,6 +19,66 @@
 #include <rtl/rtl.h>
 #include "../local-include/intr.h"
 #include "cpu/difftest.h"
+
+static word_t amo_compute(uint32_t funct5, int width, word_t old, word_t src) {
+  switch (funct5) {
+    case 0b00001: return src;
+    case 0b00000: return old + src;
+    case 0b01000: return old | src;
+    case 0b01100: return old & src;
+    case 0b00100: return old ^ src;
+    case 0b10000: // amomin
+      if (width == 8) return ((int64_t)old < (int64_t)src ? old : src);
+      else return ((int32_t)old < (int32_t)src ? old : src);
+    case 0b10100: // amomax
+      if (width == 8) return ((int64_t)old > (int64_t)src ? old : src);
+      else return ((int32_t)old > (int32_t)src ? old : src);
+    case 0b11000: // amominu
+      if (width == 8) return ((uint64_t)old < (uint64_t)src ? old : src);
+      else return ((uint32_t)old < (uint32_t)src ? old : src);
+    case 0b11100: // amomaxu
+      if (width == 8) return ((uint64_t)old > (uint64_t)src ? old : src);
+      else return ((uint32_t)old > (uint32_t)src ? old : src);
+    default: assert(0);
+  }
+}
+
+// physical address of the store of an AMO or SC, the exceptions are left in cpu.mem_exception
+static paddr_t amo_paddr(vaddr_t vaddr, int width) {
+  if (isa_mmu_check(vaddr, width, MEM_TYPE_WRITE) != MMU_TRANSLATE) return vaddr;
+  // the base of the page is returned, as in va2pa()
+  paddr_t ret = isa_mmu_translate(vaddr, width, MEM_TYPE_WRITE);
+  if ((ret & PAGE_MASK) != MEM_RET_OK) return ret;
+  return (ret & ~(paddr_t)PAGE_MASK) | (vaddr & PAGE_MASK);
+}
+
+#ifdef CONFIG_MULTI_HART
+// The other harts access the memory at the same time, so the read-modify-write
+// of AMOs and SC is done by host atomic instructions on the guest memory.
+// Return NULL if the address is not in pmem.
+static void *amo_host_addr(vaddr_t vaddr, int width) {
+  paddr_t paddr = amo_paddr(vaddr, width);
+  if (cpu.mem_exception != MEM_OK || !in_pmem(paddr) ||
+      !isa_pmp_check_permission(paddr, width, MEM_TYPE_WRITE, cpu.mode)) {
+    return NULL;
+  }
+  return guest_to_host(paddr);
+}
+
+// compare and swap on the host, return whether `expected` is found
+static bool amo_host_cas(void *p, int width, word_t *expected, word_t val) {
+  if (width == 8) {
+    return __atomic_compare_exchange_n((uint64_t *)p, (uint64_t *)expected, val,
+        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+  uint32_t old = *expected;
+  bool ok = __atomic_compare_exchange_n((uint32_t *)p, &old, val,
+      false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  *expected = (int32_t)old;
+  return ok;
+}
+#endif
+
 __attribute__((cold))
 def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src2) {
   uint32_t funct5 = s->isa.instr.r.funct7 >> 2;
@@ -29,6 +89,7 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
     cpu.lr_addr = *src1;
     cpu.lr_valid = 1;
     rtl_lms(s, dest, src1, 0, width, MMU_DYNAMIC);
+    IFDEF(CONFIG_MULTI_HART, cpu.lr_val = *dest);
     Logti("set lr vaild");
     return;
   } else if (funct5 == 0b00011) { // sc
@@ -43,7 +104,15 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
     Logti("cpu sc addr=%lx scr1=%lx vaild=%ld success=%d", cpu.lr_addr,*src1, cpu.lr_valid,success);
     cpu.lr_valid = 0;
     if (success) {
+#ifdef CONFIG_MULTI_HART
+      void *host = amo_host_addr(*src1, width);
+      return_on_mem_ex();
+      word_t expected = cpu.lr_val;
+      if (host != NULL) success = amo_host_cas(host, width, &expected, *src2);
+      else rtl_sm(s, src2, src1, 0, width, MMU_DYNAMIC);
+#else
       rtl_sm(s, src2, src1, 0, width, MMU_DYNAMIC);
+#endif
     } else {
     // Because spike skipped some exception or interrupt
     // the atomic operation would fail after handling the exception
@@ -51,10 +120,7 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
       IFDEF(CONFIG_DIFFTEST_REF_SPIKE,difftest_skip_ref());
       cpu.lr_valid = 0;
       // Even if scInvalid, SPF (if raised) also needs to be reported
-      uint64_t paddr = *dsrc1;
-      if (isa_mmu_check(*dsrc1, width, MEM_TYPE_WRITE) == MMU_TRANSLATE) {
-        paddr = isa_mmu_translate(*dsrc1, width, MEM_TYPE_WRITE);
-      }
+      uint64_t paddr = amo_paddr(*dsrc1, width);
       return_on_mem_ex();
       // Even if scInvalid, SAF (if raised) also needs to be reported
       // Check address space range and pmp
@@ -72,30 +138,18 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
 
   cpu.amo = true;
   rtl_lms(s, s0, src1, 0, width, MMU_DYNAMIC);
-  switch (funct5) {
-    case 0b00001: rtl_mv (s, s1, src2); break;
-    case 0b00000: rtl_add(s, s1, s0, src2); break;
-    case 0b01000: rtl_or (s, s1, s0, src2); break;
-    case 0b01100: rtl_and(s, s1, s0, src2); break;
-    case 0b00100: rtl_xor(s, s1, s0, src2); break;
-    case 0b10000: // amomin
-      if (width == 8) *s1 = ((int64_t)*s0 < (int64_t)*src2 ? *s0 : *src2);
-      else *s1 = ((int32_t)*s0 < (int32_t)*src2 ? *s0 : *src2);
-      break;
-    case 0b10100: // amomax
-      if (width == 8) *s1 = ((int64_t)*s0 > (int64_t)*src2 ? *s0 : *src2);
-      else *s1 = ((int32_t)*s0 > (int32_t)*src2 ? *s0 : *src2);
-      break;
-    case 0b11000: // amominu
-      if (width == 8) *s1 = ((uint64_t)*s0 < (uint64_t)*src2 ? *s0 : *src2);
-      else *s1 = ((uint32_t)*s0 < (uint32_t)*src2 ? *s0 : *src2);
-      break;
-    case 0b11100: // amomaxu
-      if (width == 8) *s1 = ((uint64_t)*s0 > (uint64_t)*src2 ? *s0 : *src2);
-      else *s1 = ((uint32_t)*s0 > (uint32_t)*src2 ? *s0 : *src2);
-      break;
-    default: assert(0);
+#ifdef CONFIG_MULTI_HART
+  void *host = amo_host_addr(*src1, width);
+  return_on_mem_ex();
+  if (host != NULL) {
+    // s0 may be stale, retry with the value in memory
+    while (!amo_host_cas(host, width, s0, amo_compute(funct5, width, *s0, *src2)));
+    rtl_mv(s, dest, s0);
+    cpu.amo = false;
+    return;
   }
+#endif
+  *s1 = amo_compute(funct5, width, *s0, *src2);
   rtl_sm(s, s1, src1, 0, width, MMU_DYNAMIC);
   rtl_mv(s, dest, s0);
   cpu.amo = false;
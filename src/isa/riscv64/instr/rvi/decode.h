@@ -24,7 +24,7 @@ static inline def_DopHelper(i) {
 
 static inline def_DopHelper(r) {
   bool load_val = flag;
-  static word_t zero_null = 0;
+  static HART_LOCAL word_t zero_null = 0;
   op->preg = (!load_val && val == 0) ? &zero_null : &reg_l(val);
   print_Dop(op->str, OP_STR_SIZE, "%s", reg_name(val, 4));
 #ifdef CONFIG_RVV
@@ -126,7 +126,7 @@ def_THelper(addi_dispatch) {
   return EXEC_ID_inv;
 }
 
-def_THelper(op_imm) {
+def_THelper(op_imm_rd) {
   if (s->isa.instr.i.rd == s->isa.instr.i.rs1) {
     def_INSTR_TAB("??????? ????? ????? 000 ????? ????? ??", c_addi_dispatch);
     def_INSTR_TAB("??????? ????? ????? 111 ????? ????? ??", c_andi);
@@ -135,6 +135,8 @@ def_THelper(op_imm) {
     def_INSTR_TAB("000000? ????? ????? 101 ????? ????? ??", c_srli);
   }
   def_INSTR_TAB("??????? ????? ????? 000 ????? ????? ??", addi_dispatch);
+  def_INSTR_TAB("0000000 00001 ????? 011 ????? ????? ??", p_seqz);
+  def_INSTR_TAB("1111111 11111 ????? 100 ????? ????? ??", p_not);
   def_INSTR_TAB("??????? ????? ????? 010 ????? ????? ??", slti);
   def_INSTR_TAB("??????? ????? ????? 011 ????? ????? ??", sltui);
   def_INSTR_TAB("??????? ????? ????? 100 ????? ????? ??", xori);
@@ -175,7 +177,7 @@ def_THelper(op_imm) {
   return EXEC_ID_inv;
 };
 
-def_THelper(op_imm32) {
+def_THelper(op_imm32_rd) {
   if (s->isa.instr.i.rd == s->isa.instr.i.rs1 && s->isa.instr.i.rd) {
     def_INSTR_TAB("??????? ????? ????? 000 ????? ????? ??", c_addiw_dispatch);
   }
@@ -194,7 +196,7 @@ def_THelper(op_imm32) {
   return EXEC_ID_inv;
 }
 
-def_THelper(op) {
+def_THelper(op_rd) {
   if (s->isa.instr.r.rd == s->isa.instr.r.rs1) {
     def_INSTR_TAB("0000000 ????? ????? 000 ????? ????? ??", c_add);
     def_INSTR_TAB("0100000 ????? ????? 000 ????? ????? ??", c_sub);
@@ -202,6 +204,10 @@ def_THelper(op) {
     def_INSTR_TAB("0000000 ????? ????? 110 ????? ????? ??", c_or);
     def_INSTR_TAB("0000000 ????? ????? 111 ????? ????? ??", c_and);
   }
+  def_INSTR_TAB("0000000 00000 ????? 010 ????? ????? ??", p_sltz);
+  def_INSTR_TAB("0000000 ????? 00000 010 ????? ????? ??", p_sgtz);
+  def_INSTR_TAB("0000000 ????? 00000 011 ????? ????? ??", p_snez);
+  def_INSTR_TAB("0100000 ????? 00000 000 ????? ????? ??", p_neg);
   def_INSTR_TAB("0000000 ????? ????? 000 ????? ????? ??", add);
   def_INSTR_TAB("0000000 ????? ????? 001 ????? ????? ??", sll);
   def_INSTR_TAB("0000000 ????? ????? 010 ????? ????? ??", slt);
@@ -253,11 +259,12 @@ def_THelper(op) {
   return EXEC_ID_inv;
 }
 
-def_THelper(op32) {
+def_THelper(op32_rd) {
   if (s->isa.instr.r.rd == s->isa.instr.r.rs1) {
     def_INSTR_TAB("0000000 ????? ????? 000 ????? ????? ??", c_addw);
     def_INSTR_TAB("0100000 ????? ????? 000 ????? ????? ??", c_subw);
   }
+  def_INSTR_TAB("0100000 ????? 00000 000 ????? ????? ??", p_negw);
   def_INSTR_TAB("0000000 ????? ????? 000 ????? ????? ??", addw);
   def_INSTR_TAB("0100000 ????? ????? 000 ????? ????? ??", subw);
   def_INSTR_TAB("0000000 ????? ????? 001 ????? ????? ??", sllw);
@@ -276,6 +283,32 @@ def_THelper(op32) {
   return EXEC_ID_inv;
 }
 
+// An ALU instruction writing x0 is a nop. It is turned into one only after
+// the whole table is matched, so that the reserved encodings with rd = x0
+// are still illegal instructions.
+#define def_x0_nop_THelper(name) \
+  def_THelper(name) { \
+    int id = concat3(table_, name, _rd)(s); \
+    return (s->isa.instr.r.rd == 0 && id != EXEC_ID_inv ? table_p_nop(s) : id); \
+  }
+
+def_x0_nop_THelper(op_imm)
+def_x0_nop_THelper(op_imm32)
+def_x0_nop_THelper(op)
+def_x0_nop_THelper(op32)
+
+def_THelper(lui_dispatch) {
+  def_INSTR_TAB("??????? ????? ????? ??? 00000 ????? ??", p_nop);
+  def_INSTR_TAB("??????? ????? ????? ??? ????? ????? ??", lui);
+  return EXEC_ID_inv;
+}
+
+def_THelper(auipc_dispatch) {
+  def_INSTR_TAB("??????? ????? ????? ??? 00000 ????? ??", p_nop);
+  def_INSTR_TAB("??????? ????? ????? ??? ????? ????? ??", auipc);
+  return EXEC_ID_inv;
+}
+
 def_THelper(branch) {
   def_INSTR_TAB("??????? 00000 ????? 000 ????? ????? ??", c_beqz);
   def_INSTR_TAB("??????? 00000 ????? 001 ????? ????? ??", c_bnez);
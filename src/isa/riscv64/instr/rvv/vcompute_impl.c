@@ -27,7 +27,7 @@
 #define s2    (&tmp_reg[2])
 #define s3    (&tmp_reg[3])
 
-rtlvreg_t tmp_vreg[8];
+HART_LOCAL rtlvreg_t tmp_vreg[8];
 
 typedef __uint128_t uint128_t;
 typedef __int128_t int128_t;
@@ -414,19 +414,34 @@ CSR_STRUCT_END(sip)
 #define SATP_ASID_MAX_LEN 16
 #define SATP_PADDR_MAX_LEN 44
 
-#define SATP_MODE_MASK (8UL << (SATP_ASID_MAX_LEN + SATP_PADDR_MAX_LEN))
+#define SATP_MODE_MASK (0xfUL << (SATP_ASID_MAX_LEN + SATP_PADDR_MAX_LEN))
 #define SATP_ASID_MASK (((1L << SATP_ASID_LEN)-1) << SATP_PADDR_MAX_LEN)
 #define SATP_PADDR_MASK ((1L << SATP_PADDR_LEN)-1)
 
 #define SATP_MASK (SATP_MODE_MASK | SATP_ASID_MASK | SATP_PADDR_MASK)
 #define MASKED_SATP(x) (SATP_MASK & x)
 
+// the modes of satp/vsatp, and of hgatp with the x4 variants
+#define SATP_MODE_BARE 0
+#define SATP_MODE_SV39 8
+#define SATP_MODE_SV48 9
+#define SATP_MODE_SV57 10
+// number of levels of the page table, Sv39 has 3
+#define SATP_MODE_LEVELS(mode) ((mode) - 5)
+
+// writes setting an unsupported mode are ignored
+static inline bool satp_mode_legal(word_t mode) {
+  return mode == SATP_MODE_BARE || mode == SATP_MODE_SV39 ||
+    (ISDEF(CONFIG_RV_SV48) && mode == SATP_MODE_SV48) ||
+    (ISDEF(CONFIG_RV_SV57) && mode == SATP_MODE_SV57);
+}
+
 #define HGATP_VMID_LEN 14 // max is 14
 #define HGATP_PADDR_LEN 44 // max is 44
 #define HGATP_VMID_MAX_LEN 16
 #define HGATP_PADDR_MAX_LEN 44
 
-#define HGATP_MODE_MASK (8UL << (HGATP_VMID_MAX_LEN + HGATP_PADDR_MAX_LEN))
+#define HGATP_MODE_MASK (0xfUL << (HGATP_VMID_MAX_LEN + HGATP_PADDR_MAX_LEN))
 #define HGATP_VMID_MASK (((1L << HGATP_VMID_LEN)-1) << HGATP_PADDR_MAX_LEN)
 #define HGATP_PADDR_MASK ((1L << HGATP_PADDR_MAX_LEN)-1)
 
@@ -827,7 +842,11 @@ CSR_STRUCT_START(vsatp)
 CSR_STRUCT_END(vsatp)
 #endif //CONFIG_RVH
 
+#ifdef CONFIG_MULTI_HART
+#define CSRS_DECL(name, addr) extern HART_LOCAL concat(name, _t)* name;
+#else
 #define CSRS_DECL(name, addr) extern concat(name, _t)* const name;
+#endif
 MAP(CSRS, CSRS_DECL)
 #ifdef CONFIG_RVV
   MAP(VCSRS, CSRS_DECL)
@@ -91,7 +91,7 @@ word_t raise_intr(word_t NO, vaddr_t epc) {
 #endif
   bool delegS = intr_deleg_S(NO);
 #ifdef CONFIG_RVH
-  extern bool hld_st;
+  extern HART_LOCAL bool hld_st;
   int hld_st_temp = hld_st;
   hld_st = 0;
   bool delegVS = intr_deleg_VS(NO);
@@ -18,6 +18,7 @@
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
 #include <memory/host.h>
+#include <memory/host-tlb.h>
 #include <cpu/cpu.h>
 #include "../local-include/csr.h"
 #include "../local-include/intr.h"
@@ -43,8 +44,8 @@ typedef union PageTableEntry {
 #define PGMASK ((1ull << PGSHFT) - 1)
 #define PGBASE(pn) (pn << PGSHFT)
 
-// Sv39 page walk
-#define PTW_LEVEL 3
+// Sv39/Sv48/Sv57 page walk, the number of levels is given by the mode
+#define PTW_MAX_LEVEL MUXDEF(CONFIG_RV_SV57, 5, MUXDEF(CONFIG_RV_SV48, 4, 3))
 #define PTE_SIZE 8
 #define VPNMASK 0x1ff
 #define GPVPNMASK 0x7ff
@@ -55,11 +56,12 @@ static inline uintptr_t VPNi(vaddr_t va, int i) {
   return (va >> VPNiSHFT(i)) & VPNMASK;
 }
 #ifdef CONFIG_RVH
-static inline uintptr_t GVPNi(vaddr_t va, int i) {
-  return (i == 2)?  (va >> VPNiSHFT(i)) & GPVPNMASK : (va >> VPNiSHFT(i)) & VPNMASK;
+// the root table of G-stage is 4 times larger
+static inline uintptr_t GVPNi(vaddr_t va, int i, int levels) {
+  return (i == levels - 1)?  (va >> VPNiSHFT(i)) & GPVPNMASK : (va >> VPNiSHFT(i)) & VPNMASK;
 }
-  bool hlvx = 0;
-  bool hld_st = 0;
+  HART_LOCAL bool hlvx = 0;
+  HART_LOCAL bool hld_st = 0;
 #endif
 #ifdef CONFIG_RVH
 static inline bool check_permission(PTE *pte, bool ok, vaddr_t vaddr, int type, int virt, int mode) {
@@ -145,8 +147,11 @@ static inline bool check_permission(PTE *pte, bool ok, vaddr_t vaddr, int type)
   return true;
 }
 #ifdef CONFIG_RVH
-bool has_two_stage_translation(){
-  return hld_st || (mstatus->mprv && mstatus->mpv) || cpu.v;
+// The host TLB caches the two-stage translation in virtualization mode,
+// but not the one of hypervisor loads/stores and MPRV accesses with MPV,
+// which differs from the translation of instruction fetch.
+bool hosttlb_bypass_two_stage(){
+  return hld_st || (!cpu.v && mstatus->mprv && mstatus->mpv);
 }
 
 void raise_guest_excep(paddr_t gpaddr, vaddr_t vaddr, int type){
@@ -189,18 +194,23 @@ void raise_guest_excep(paddr_t gpaddr, vaddr_t vaddr, int type){
   }
 }
 
+// page shift of the leaf found by the last G-stage translation
+static HART_LOCAL int gpa_page_shift = 0;
+
 paddr_t gpa_stage(paddr_t gpaddr, vaddr_t vaddr, int type){
   Logtr("gpa_stage gpaddr: 0x%lx, vaddr: 0x%lx, type: %d", gpaddr, vaddr, type);
-  if(hgatp->mode == 8){
-    if((gpaddr & ~(((int64_t)1 << 41) - 1)) != 0){
+  gpa_page_shift = VPNiSHFT(PTW_MAX_LEVEL);
+  if(hgatp->mode != SATP_MODE_BARE){
+    int levels = SATP_MODE_LEVELS(hgatp->mode);
+    if((gpaddr & ~(((int64_t)1 << (VPNiSHFT(levels) + 2)) - 1)) != 0){
       raise_guest_excep(gpaddr, vaddr, type);
     }
     word_t pg_base = PGBASE(hgatp->ppn);
     int level;
     word_t p_pte;
     PTE pte;
-    for (level = PTW_LEVEL - 1; level >=0;){
-      p_pte = pg_base + GVPNi(gpaddr, level) * PTE_SIZE;
+    for (level = levels - 1; level >=0;){
+      p_pte = pg_base + GVPNi(gpaddr, level, levels) * PTE_SIZE;
       pte.val	= paddr_read(p_pte, PTE_SIZE,
       type == MEM_TYPE_IFETCH ? MEM_TYPE_IFETCH_READ :
       type == MEM_TYPE_WRITE ? MEM_TYPE_WRITE_READ : MEM_TYPE_READ, MODE_S, vaddr);
@@ -233,6 +243,7 @@ paddr_t gpa_stage(paddr_t gpaddr, vaddr_t vaddr, int type){
           }
           pg_base = (pg_base & ~pg_mask) | (gpaddr & pg_mask & ~PGMASK);
         }
+        gpa_page_shift = VPNiSHFT(level);
         return pg_base | (gpaddr & PAGE_MASK);
       }
     }
@@ -262,9 +273,62 @@ static word_t pte_read(paddr_t addr, int type, int mode, vaddr_t vaddr) {
 }
 #endif // CONFIG_MULTICORE_DIFF
 
+// Page walk cache. The non-leaf PTEs are cached by the satp of the walk and
+// the VPN prefix they translate, like the hardware PWCs. pwc[i] holds the
+// base of the table of level i, so a walk which hits in pwc[0] reads only
+// the leaf PTE. Only the walks with one stage are cached.
+#define PWC_SIZE 64
+
+typedef struct {
+  word_t satp;  // 0 if the entry is invalid, bare satp never walks
+  vaddr_t vpn;  // VPN prefix above level i
+  word_t pg_base;
+} PWCEntry;
+
+static HART_LOCAL PWCEntry pwc[PTW_MAX_LEVEL - 1][PWC_SIZE];
+static HART_LOCAL uint64_t pwc_nr_walk = 0, pwc_nr_hit[PTW_MAX_LEVEL - 1] = {};
+
+static inline PWCEntry *pwc_entry(int level, vaddr_t vaddr) {
+  vaddr_t vpn = vaddr >> VPNiSHFT(level + 1);
+  return &pwc[level][(vpn ^ satp->ppn ^ satp->asid) % PWC_SIZE];
+}
+
+void pwc_flush() {
+  memset(pwc, 0, sizeof(pwc));
+}
+
+void isa_mmu_statistic() {
+  uint64_t nr_hit = 0;
+  char buf[128];
+  int len = 0;
+  for (int i = 0; i < PTW_MAX_LEVEL - 1; i ++) {
+    nr_hit += pwc_nr_hit[i];
+    len += snprintf(buf + len, sizeof(buf) - len, "%sL%d %'ld", i ? ", " : "", i + 1, pwc_nr_hit[i]);
+  }
+  Log("ptw: %'ld walks, page walk cache hit rate %.2f%% (%s)", pwc_nr_walk,
+      pwc_nr_walk ? 100.0 * nr_hit / pwc_nr_walk : 0.0, buf);
+}
+
+bool pmp_region_uniform(paddr_t base, word_t size);
+
+// Report the size of the page to the host TLB, so it can map the whole
+// superpage at once. The page is limited by the G-stage page with two-stage
+// translation, and by the PMP regions which do not cover all of it. A page
+// which is not covered by one PMP region is reported as 0, and is not
+// cached by the host TLB. The size of the leaf PTE itself is reported too,
+// since a flush of any page in it drops the entry.
+static inline void ptw_report_page_shift(paddr_t paddr, int shift, int leaf_shift) {
+  hosttlb_leaf_shift = leaf_shift;
+  for (; shift >= PAGE_SHIFT; shift -= 9) {
+    if (pmp_region_uniform(paddr & ~((1ull << shift) - 1), 1ull << shift)) break;
+  }
+  hosttlb_page_shift = (shift < PAGE_SHIFT ? 0 : shift);
+}
+
 static paddr_t ptw(vaddr_t vaddr, int type) {
   Logtr("Page walking for 0x%lx\n", vaddr);
   word_t pg_base = PGBASE(satp->ppn);
+  int levels = SATP_MODE_LEVELS(satp->mode);
 #ifdef CONFIG_RVH
   int virt = cpu.v;
   int mode = cpu.mode;
@@ -279,17 +343,37 @@ static paddr_t ptw(vaddr_t vaddr, int type) {
     }
   }
   if(virt){
-    if(vsatp_mode == 0) return gpa_stage(vaddr, vaddr, type) & ~PAGE_MASK;
+    if(vsatp_mode == 0) {
+      pg_base = gpa_stage(vaddr, vaddr, type) & ~PAGE_MASK;
+      ptw_report_page_shift(pg_base, gpa_page_shift, gpa_page_shift);
+      return pg_base;
+    }
     pg_base = PGBASE(vsatp_ppn);
+    levels = SATP_MODE_LEVELS(vsatp_mode);
   }
 #endif
   word_t p_pte; // pte pointer
   PTE pte;
   int level;
-  int64_t vaddr39 = vaddr << (64 - 39);
-  vaddr39 >>= (64 - 39);
-  if ((uint64_t)vaddr39 != vaddr) goto bad;
-  for (level = PTW_LEVEL - 1; level >= 0;) {
+  int va_bits = VPNiSHFT(levels);
+  int64_t vaddr_sext = vaddr << (64 - va_bits);
+  vaddr_sext >>= (64 - va_bits);
+  if ((uint64_t)vaddr_sext != vaddr) goto bad;
+  level = levels - 1;
+  bool use_pwc = MUXDEF(CONFIG_RVH, !virt, true);
+  if (use_pwc) {
+    pwc_nr_walk ++;
+    for (int i = 0; i < levels - 1; i ++) {
+      PWCEntry *e = pwc_entry(i, vaddr);
+      if (e->satp == satp->val && e->vpn == vaddr >> VPNiSHFT(i + 1)) {
+        pwc_nr_hit[i] ++;
+        pg_base = e->pg_base;
+        level = i;
+        break;
+      }
+    }
+  }
+  while (level >= 0) {
     p_pte = pg_base + VPNi(vaddr, level) * PTE_SIZE;
 #ifdef CONFIG_MULTICORE_DIFF
     pte.val = golden_pmem_read(p_pte, PTE_SIZE, 0, 0, 0);
@@ -313,6 +397,12 @@ static paddr_t ptw(vaddr_t vaddr, int type) {
     else {
       level --;
       if (level < 0) { goto bad; }
+      if (use_pwc) {
+        PWCEntry *e = pwc_entry(level, vaddr);
+        e->satp = satp->val;
+        e->vpn = vaddr >> VPNiSHFT(level + 1);
+        e->pg_base = pg_base;
+      }
     }
   }
 #ifdef CONFIG_RVH
@@ -408,6 +498,9 @@ static paddr_t ptw(vaddr_t vaddr, int type) {
   }
 #endif // CONFIG_SHARE
 
+  int page_shift = VPNiSHFT(level), leaf_shift = page_shift;
+  IFDEF(CONFIG_RVH, if (virt && gpa_page_shift < page_shift) page_shift = gpa_page_shift);
+  ptw_report_page_shift(pg_base, page_shift, leaf_shift);
   return pg_base | MEM_RET_OK;
 
 bad:
@@ -420,16 +513,16 @@ bad:
   return MEM_RET_FAIL;
 }
 
-int ifetch_mmu_state = MMU_DIRECT;
-int data_mmu_state = MMU_DIRECT;
+HART_LOCAL int ifetch_mmu_state = MMU_DIRECT;
+HART_LOCAL int data_mmu_state = MMU_DIRECT;
 #ifdef CONFIG_RVH
-static int h_mmu_state = MMU_DIRECT;
+static HART_LOCAL int h_mmu_state = MMU_DIRECT;
 static inline int update_h_mmu_state_internal(bool ifetch) {
   uint32_t mode = (mstatus->mprv && (!ifetch) ? mstatus->mpp : cpu.mode);
   if (mode < MODE_M) {
-    assert(vsatp_mode == 0 || vsatp_mode == 8);
-    assert(hgatp->mode == 0 || hgatp->mode == 8);
-    if (vsatp_mode == 8 || hgatp->mode == 8) return MMU_TRANSLATE;
+    assert(satp_mode_legal(vsatp_mode));
+    assert(satp_mode_legal(hgatp->mode));
+    if (vsatp_mode != SATP_MODE_BARE || hgatp->mode != SATP_MODE_BARE) return MMU_TRANSLATE;
   }
   return MMU_DIRECT;
 }
@@ -445,8 +538,8 @@ int get_data_mmu_state() {
 static inline int update_mmu_state_internal(bool ifetch) {
   uint32_t mode = (mstatus->mprv && (!ifetch) ? mstatus->mpp : cpu.mode);
   if (mode < MODE_M) {
-    assert(satp->mode == 0 || satp->mode == 8);
-    if (satp->mode == 8) return MMU_TRANSLATE;
+    assert(satp_mode_legal(satp->mode));
+    if (satp->mode != SATP_MODE_BARE) return MMU_TRANSLATE;
   }
   return MMU_DIRECT;
 }
@@ -458,6 +551,26 @@ int update_mmu_state() {
 #ifdef CONFIG_RVH
   h_mmu_state = update_h_mmu_state_internal(false);
 #endif
+  // entries of the host TLB are tagged with satp (asid | ppn) and the privilege,
+  // or with vsatp and hgatp (vmid | ppn) in virtualization mode, and with SUM
+  // and MXR, which check_permission() depends on
+  uint64_t priv = cpu.mode | ((mstatus->mprv ? mstatus->mpp : cpu.mode) << 2) |
+    ((uint64_t)mstatus->sum << 6) | ((uint64_t)mstatus->mxr << 7);
+#ifdef CONFIG_RVH
+  if (cpu.v) {
+    bool vs32 = (hstatus->vsxl == 1);
+    priv |= ((uint64_t)(vs32 ? vsstatus->_32.sum : vsstatus->_64.sum) << 8) |
+      ((uint64_t)(vs32 ? vsstatus->_32.mxr : vsstatus->_64.mxr) << 9);
+  }
+  // the host TLB is bypassed with mprv and mpv, see hosttlb_bypass_two_stage(),
+  // and the context is never filled, so the lookups inlined by the JIT miss
+  if (!cpu.v && mstatus->mprv && mstatus->mpv) priv |= 1 << 5;
+  if (cpu.v) {
+    hosttlb_set_context(vsatp->val, hgatp->val, priv | (1 << 4));
+    return (data_mmu_state ^ data_mmu_state_old) ? true : false;
+  }
+#endif
+  hosttlb_set_context(satp->val, 0, priv);
   return (data_mmu_state ^ data_mmu_state_old) ? true : false;
 }
 
@@ -474,18 +587,23 @@ int isa_mmu_check(vaddr_t vaddr, int len, int type) {
   // riscv-privileged 4.4.1: Addressing and Memory Protection:
   // Instruction fetch addresses and load and store effective addresses,
   // which are 64 bits, must have bits 63–39 all equal to bit 38, or else a page-fault exception will occur.
+  // It is bits 63-48 for Sv48 and bits 63-57 for Sv57.
 #ifdef CONFIG_RVH
-  bool vm_enable = (mstatus->mprv && (!is_ifetch) ? mstatus->mpp : cpu.mode) < MODE_M && (satp->mode == 8 || (cpu.v && (vsatp_mode == 8 || hgatp->mode == 8)));
+  bool vm_enable = (mstatus->mprv && (!is_ifetch) ? mstatus->mpp : cpu.mode) < MODE_M && (satp->mode != SATP_MODE_BARE || (cpu.v && (vsatp_mode != SATP_MODE_BARE || hgatp->mode != SATP_MODE_BARE)));
+  int va_mode = (cpu.v ? vsatp_mode : satp->mode);
 #else
-  bool vm_enable = (mstatus->mprv && (!is_ifetch) ? mstatus->mpp : cpu.mode) < MODE_M && satp->mode == 8;
+  bool vm_enable = (mstatus->mprv && (!is_ifetch) ? mstatus->mpp : cpu.mode) < MODE_M && satp->mode != SATP_MODE_BARE;
+  int va_mode = satp->mode;
 #endif
-  word_t va_mask = ((((word_t)1) << (63 - 38 + 1)) - 1);
-  word_t va_msbs = vaddr >> 38;
+  int va_bits = VPNiSHFT(va_mode == SATP_MODE_BARE ? 3 : SATP_MODE_LEVELS(va_mode));
+  word_t va_mask = ((((word_t)1) << (64 - va_bits + 1)) - 1);
+  word_t va_msbs = vaddr >> (va_bits - 1);
   bool va_msbs_ok = (va_msbs == va_mask) || va_msbs == 0 || !vm_enable;
 #ifdef CONFIG_RVH
   bool gpf = false;
   if(cpu.v && vsatp_mode == 0){ // don't need bits 63–39 are equal to bit 38
-    word_t maxgpa = ((((word_t)1) << 41) - 1);
+    int gpa_bits = VPNiSHFT(hgatp->mode == SATP_MODE_BARE ? 3 : SATP_MODE_LEVELS(hgatp->mode)) + 2;
+    word_t maxgpa = ((((word_t)1) << gpa_bits) - 1);
     if((vaddr & ~maxgpa) == 0){
       va_msbs_ok = 1;
     }else{
@@ -619,8 +737,8 @@ paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
 }
 
 int force_raise_pf_record(vaddr_t vaddr, int type) {
-  static vaddr_t last_addr[3] = {0x0};
-  static int force_count[3] = {0};
+  static HART_LOCAL vaddr_t last_addr[3] = {0x0};
+  static HART_LOCAL int force_count[3] = {0};
   if (vaddr != last_addr[type]) {
     last_addr[type] = vaddr;
     force_count[type] = 0;
@@ -706,8 +824,8 @@ int force_raise_pf(vaddr_t vaddr, int type){
 
 #ifdef CONFIG_RVH
 int force_raise_gpf_record(vaddr_t vaddr, int type) {
-  static vaddr_t g_last_addr[3] = {0x0};
-  static int g_force_count[3] = {0};
+  static HART_LOCAL vaddr_t g_last_addr[3] = {0x0};
+  static HART_LOCAL int g_force_count[3] = {0};
   if (vaddr != g_last_addr[type]) {
     g_last_addr[type] = vaddr;
     g_force_count[type] = 0;
@@ -912,6 +1030,73 @@ bool pmptable_check_permission(word_t offset, word_t root_table_base, int type,
 }
 #endif
 
+#ifdef CONFIG_RV_PMP_CHECK
+// Find the first PMP region which overlaps [base, base + size). Return its
+// index, or -1 if there is none, and set *full if it covers the whole range.
+static int pmp_region_match(paddr_t base, word_t size, bool *full) {
+  word_t lo = 0;
+  for (int i = 0; i < CONFIG_RV_PMP_NUM; i++) {
+    word_t pmpaddr = pmpaddr_from_index(i);
+    word_t tor = (pmpaddr & pmp_tor_mask()) << PMP_SHIFT;
+    uint8_t cfg = pmpcfg_from_index(i);
+    // the region is [start, last]
+    word_t start = lo, last = tor - 1;
+    lo = tor;
+    if (!(cfg & PMP_A)) continue;
+    if ((cfg & PMP_A) == PMP_TOR) {
+      if (start >= tor) continue;
+    } else {
+      bool is_na4 = (cfg & PMP_A) == PMP_NA4;
+      word_t mask = (pmpaddr << 1) | (!is_na4) | ~pmp_tor_mask();
+      mask = ~(mask & ~(mask + 1)) << PMP_SHIFT;
+      start = tor & mask;
+      last = start + ~mask;
+    }
+    if (last < base || base + size - 1 < start) continue;
+    *full = start <= base && base + size - 1 <= last;
+    return i;
+  }
+  return -1;
+}
+
+// PMP permission cache. With one PMP region covering a page, the result of
+// the check only depends on the page, the type of the access, and whether
+// the mode is M. pmp_page_perm[] keeps the results for every page of pmem.
+// It is filled at the first check of a page, and dropped when a PMP CSR is
+// written.
+#define PMP_PERM_VALID 0x80
+#define PMP_PERM_SLOW  0x40 // not covered by one region, use the full check
+#define PMP_PERM_NONM_SHIFT 3
+static HART_LOCAL uint8_t pmp_page_perm[CONFIG_MSIZE >> PAGE_SHIFT];
+
+void pmp_cache_flush() {
+  memset(pmp_page_perm, 0, sizeof(pmp_page_perm));
+}
+
+static uint8_t pmp_page_perm_fill(paddr_t page) {
+  bool full = false;
+  int i = pmp_region_match(page, PAGE_SIZE, &full);
+  if (i < 0) return PMP_PERM_VALID | PMP_R | PMP_W | PMP_X;
+  if (!full) return PMP_PERM_VALID | PMP_PERM_SLOW;
+  uint8_t cfg = pmpcfg_from_index(i);
+  uint8_t perm = cfg & (PMP_R | PMP_W | PMP_X);
+  uint8_t m_perm = (cfg & PMP_L) ? perm : (PMP_R | PMP_W | PMP_X);
+  return PMP_PERM_VALID | m_perm | (perm << PMP_PERM_NONM_SHIFT);
+}
+#endif
+
+// Whether all bytes of [base, base + size) get the same PMP result.
+bool pmp_region_uniform(paddr_t base, word_t size) {
+#ifdef CONFIG_PMPTABLE_EXTENSION
+  return size <= PAGE_SIZE;
+#elif defined(CONFIG_RV_PMP_CHECK)
+  bool full = false;
+  return pmp_region_match(base, size, &full) < 0 || full;
+#else
+  return true;
+#endif
+}
+
 bool isa_pmp_check_permission(paddr_t addr, int len, int type, int out_mode) {
   bool ifetch = (type == MEM_TYPE_IFETCH);
   __attribute__((unused)) uint32_t mode;
@@ -931,6 +1116,16 @@ bool isa_pmp_check_permission(paddr_t addr, int len, int type, int out_mode) {
     return true;
   }
 
+  paddr_t offset = addr - CONFIG_MBASE;
+  if (likely(offset < CONFIG_MSIZE && (offset & PAGE_MASK) + len <= PAGE_SIZE)) {
+    uint8_t *perm = &pmp_page_perm[offset >> PAGE_SHIFT];
+    if (unlikely(!(*perm & PMP_PERM_VALID))) *perm = pmp_page_perm_fill(addr & ~PAGE_MASK);
+    if (likely(!(*perm & PMP_PERM_SLOW))) {
+      int bit = (type == MEM_TYPE_WRITE ? PMP_W : type == MEM_TYPE_IFETCH ? PMP_X : PMP_R);
+      return (*perm >> (mode == MODE_M ? 0 : PMP_PERM_NONM_SHIFT)) & bit;
+    }
+  }
+
   word_t base = 0;
   for (int i = 0; i < CONFIG_RV_PMP_NUM; i++) {
     word_t pmpaddr = pmpaddr_from_index(i);
@@ -21,18 +21,27 @@
 #include <cpu/cpu.h>
 #include <cpu/difftest.h>
 #include <memory/paddr.h>
+#include <memory/host-tlb.h>
 #include <stdlib.h>
 
 int update_mmu_state();
+void pwc_flush();
+void pmp_cache_flush();
 uint64_t clint_uptime();
 void fp_set_dirty();
 void fp_update_rm_cache(uint32_t rm);
 void vp_set_dirty();
 
-rtlreg_t csr_array[4096] = {};
+HART_LOCAL rtlreg_t csr_array[4096] = {};
 
+#ifdef CONFIG_MULTI_HART
+// the address of csr_array is only known in the thread of the hart
+#define CSRS_DEF(name, addr) HART_LOCAL concat(name, _t)* name;
+#define CSRS_PTR(name, addr) name = (concat(name, _t) *)&csr_array[addr];
+#else
 #define CSRS_DEF(name, addr) \
   concat(name, _t)* const name = (concat(name, _t) *)&csr_array[addr];
+#endif
 
 MAP(CSRS, CSRS_DEF)
 #ifdef CONFIG_RVV
@@ -48,6 +57,18 @@ MAP(CSRS, CSRS_DEF)
 #define CSRS_EXIST(name, addr) csr_exist[addr] = 1;
 static bool csr_exist[4096] = {};
 void init_csr() {
+#ifdef CONFIG_MULTI_HART
+  MAP(CSRS, CSRS_PTR)
+  #ifdef CONFIG_RVV
+  MAP(VCSRS, CSRS_PTR)
+  #endif // CONFIG_RVV
+  #ifdef CONFIG_RV_ARCH_CSRS
+  MAP(ARCH_CSRS, CSRS_PTR)
+  #endif // CONFIG_RV_ARCH_CSRS
+  #ifdef CONFIG_RVH
+  MAP(HCSRS, CSRS_PTR)
+  #endif
+#endif
   MAP(CSRS, CSRS_EXIST)
   MAP(CSRS_HPM, CSRS_EXIST)
   #ifdef CONFIG_RVV
@@ -178,7 +199,6 @@ static inline word_t* csr_decode(uint32_t addr) {
 #define FFLAGS_MASK 0x1f
 #define FRM_MASK 0x07
 #define FCSR_MASK 0xff
-#define SATP_SV39_MASK 0xf000000000000000ULL
 #define is_read(csr) (src == (void *)(csr))
 #define is_write(csr) (dest == (void *)(csr))
 #define is_read_pmpcfg (src >= &(csr_array[CSR_PMPCFG0]) && src < (&(csr_array[CSR_PMPCFG0]) + (MAX_NUM_PMP/4)))
@@ -392,7 +412,7 @@ static inline void csr_write(word_t *dest, word_t src) {
       if (cpu.mode == MODE_S && hstatus->vtvm == 1) {
         longjmp_exception(EX_VI);
       }
-      if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0)
+      if (satp_mode_legal(src >> 60))
         vsatp->val = MASKED_SATP(src);
     }else if( is_write(stvec))  {vstvec->val = src & ~(0x2UL);}
   }else if (is_write(mideleg)){
@@ -427,7 +447,7 @@ static inline void csr_write(word_t *dest, word_t src) {
     if (cpu.mode == MODE_S && hstatus->vtvm == 1) {
       longjmp_exception(EX_VI);
     }
-    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0)
+    if (satp_mode_legal(src >> 60))
       vsatp->val = MASKED_SATP(src);
   }else if(is_write(hcounteren)){
     hcounteren->val = mask_bitset(hcounteren->val, COUNTEREN_MASK, src);
@@ -554,6 +574,8 @@ static inline void csr_write(word_t *dest, word_t src) {
 #endif
 
     mmu_tlb_flush(0);
+    pwc_flush();
+    IFDEF(CONFIG_RV_PMP_CHECK, pmp_cache_flush());
   }
   else if (is_write_pmpcfg) {
     // Log("Writing pmp config");
@@ -588,14 +610,16 @@ static inline void csr_write(word_t *dest, word_t src) {
     *dest = cfg_data;
 
     mmu_tlb_flush(0);
+    pwc_flush();
+    IFDEF(CONFIG_RV_PMP_CHECK, pmp_cache_flush());
   }
 #endif
   else if (is_write(satp)) {
     if (cpu.mode == MODE_S && mstatus->tvm == 1) {
       longjmp_exception(EX_II);
     }
-    // Only support Sv39, ignore write that sets other mode
-    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0)
+    // Only support Sv39 (and Sv48/Sv57 if enabled), ignore write that sets other mode
+    if (satp_mode_legal(src >> 60))
       *dest = MASKED_SATP(src);
 #ifdef CONFIG_RVSDTRIG
   } else if (is_write(tselect)) {
@@ -628,8 +652,8 @@ static inline void csr_write(word_t *dest, word_t src) {
   }
 #ifdef CONFIG_RVH
   else if (is_write(hgatp)) {
-    // Only support Sv39, ignore write that sets other mode
-    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0)
+    // Only support Sv39x4 (and Sv48x4/Sv57x4 if enabled), ignore write that sets other mode
+    if (satp_mode_legal(src >> 60))
       hgatp->val = MASKED_HGATP(src);
   }
 #endif// CONFIG_RVH
@@ -656,7 +680,8 @@ static inline void csr_write(word_t *dest, word_t src) {
     update_mstatus_sd();
   }
 #ifdef CONFIG_RVH
-  if (is_write(mstatus) || is_write(satp) || is_write(vsatp) || is_write(hgatp)) { update_mmu_state(); }
+  if (is_write(mstatus) || is_write(sstatus) || is_write(vsstatus) ||
+      is_write(satp) || is_write(vsatp) || is_write(hgatp)) { update_mmu_state(); }
   if (is_write(hstatus)) {
     set_sys_state_flag(SYS_STATE_FLUSH_TCACHE); // maybe change virtualization mode
   }
@@ -664,9 +689,10 @@ static inline void csr_write(word_t *dest, word_t src) {
     update_vsstatus_sd();
   }
 #else
-  if (is_write(mstatus) || is_write(satp)) { update_mmu_state(); }
+  if (is_write(mstatus) || is_write(sstatus) || is_write(satp)) { update_mmu_state(); }
 #endif
-  if (is_write(satp)) { mmu_tlb_flush(0); } // when satp is changed(asid | ppn), flush tlb.
+  // the host TLB is tagged with satp, but the tcache is indexed by virtual pc
+  if (is_write(satp)) { set_sys_state_flag(SYS_STATE_FLUSH_TCACHE); }
   if (is_write(mstatus) || is_write(sstatus) || is_write(satp) ||
       is_write(mie) || is_write(sie) || is_write(mip) || is_write(sip)) {
     set_sys_state_flag(SYS_STATE_UPDATE);
@@ -690,6 +716,20 @@ static void csrrw(rtlreg_t *dest, const rtlreg_t *src, uint32_t csrid) {
   if (src != NULL) { csr_write(csr, tmp); }
 }
 
+static void sfence_vma(uint32_t op, vaddr_t vaddr) {
+  // the non-leaf PTEs may be changed even if rs1 != x0
+  pwc_flush();
+  int rs2 = op & 0x1f;
+  if (vaddr == 0 && rs2 != 0) {
+    // only drop the address space of the asid, global mappings may be kept
+    word_t asid = cpu.gpr[rs2]._64;
+    hosttlb_flush_context(SATP_ASID_MASK, (asid << SATP_PADDR_MAX_LEN) & SATP_ASID_MASK);
+    set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
+  } else {
+    mmu_tlb_flush(vaddr);
+  }
+}
+
 static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
   switch (op) {
 #ifndef CONFIG_MODE_USER
@@ -718,6 +758,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
         // vsstatus->spp = MODE_U;
         // vsstatus->sie = vsstatus->spie;
         // vsstatus->spie = 1;
+        update_mmu_state();
         return vsepc->val;
       }
 #endif // CONFIG_RVH
@@ -796,7 +837,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
           if ((cpu.mode == MODE_S && mstatus->tvm == 1) || cpu.mode == MODE_U)
             longjmp_exception(EX_II);
 #endif // CONFIG_RVH
-          mmu_tlb_flush(*src);
+          sfence_vma(op, *src);
           break;
 #ifdef CONFIG_RV_SVINVAL
         case 0x0b: // sinval.vma
@@ -821,7 +862,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
             longjmp_exception(EX_II);
           }
 #endif // CONFIG_RVH
-          mmu_tlb_flush(*src);
+          sfence_vma(op, *src);
           break;
 #endif // CONFIG_RV_SVINVAL
 #ifdef CONFIG_RVH
@@ -835,7 +876,9 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
           if(cpu.v) longjmp_exception(EX_VI);
           if(cpu.mode == MODE_U) longjmp_exception(EX_II);
           if(!(cpu.mode == MODE_M || (cpu.mode == MODE_S && !cpu.v && mstatus->tvm == 0))) longjmp_exception(EX_II);
-          mmu_tlb_flush(*src);
+          // the host TLB is indexed by guest virtual address, so the guest
+          // physical address can not be used to find the entries to drop
+          mmu_tlb_flush(0);
           break;
 #ifdef CONFIG_RV_SVINVAL
         case 0x13: // hinval.vvma
@@ -846,7 +889,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
         case 0x33: // hinval.gvma
           if(cpu.v) longjmp_exception(EX_VI);
           if(cpu.mode == MODE_U || (cpu.mode == MODE_S && !cpu.v && mstatus->tvm)) longjmp_exception(EX_II);
-          mmu_tlb_flush(*src);
+          mmu_tlb_flush(0);
           break;
 #endif // CONFIG_SVINVAL
 #endif // CONFIG_RVH
@@ -886,12 +929,12 @@ void isa_hostcall(uint32_t id, rtlreg_t *dest, const rtlreg_t *src1,
 
 #ifdef CONFIG_RVH
 int rvh_hlvx_check(struct Decode *s, int type){
-  extern bool hlvx;
+  extern HART_LOCAL bool hlvx;
   hlvx = (s->isa.instr.i.opcode6_2 == 0x1c && s->isa.instr.i.funct3 == 0x4
                   && (s->isa.instr.i.simm11_0 == 0x643 || s->isa.instr.i.simm11_0 == 0x683));
   return hlvx;
 }
-extern bool hld_st;
+extern HART_LOCAL bool hld_st;
 int hload(Decode *s, rtlreg_t *dest, const rtlreg_t * src1, uint32_t id){
   hld_st = true;
   if(!(cpu.mode == MODE_M || cpu.mode == MODE_S || (cpu.mode == MODE_U && hstatus->hu))){
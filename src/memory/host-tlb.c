@@ -16,45 +16,266 @@
 
 #include <isa.h>
 #include <memory/host.h>
+#include <memory/host-tlb.h>
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
 #include <memory/sparseram.h>
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
+#include <stddef.h>
 
 #define HOSTTLB_SIZE_SHIFT 12
 #define HOSTTLB_SIZE (1 << HOSTTLB_SIZE_SHIFT)
 
 typedef struct {
   uint8_t *offset; // offset from the guest virtual address of the data page to the host virtual address
-  vaddr_t gvpn; // guest virtual page number
+  vaddr_t gvpn; // guest virtual page number, tagged with the id of the context in the upper bits
 } HostTLBEntry;
 
-static HostTLBEntry hosttlb[HOSTTLB_SIZE * 3];
-static HostTLBEntry* const hostrtlb = &hosttlb[0];
-static HostTLBEntry* const hostwtlb = &hosttlb[HOSTTLB_SIZE];
-static HostTLBEntry* const hostxtlb = &hosttlb[HOSTTLB_SIZE * 2];
+static HART_LOCAL HostTLBEntry hosttlb[HOSTTLB_SIZE * 3];
+#define hostrtlb (&hosttlb[0])
+#define hostwtlb (&hosttlb[HOSTTLB_SIZE])
+#define hostxtlb (&hosttlb[HOSTTLB_SIZE * 2])
+
+// A context is the address space (and the guest physical address space
+// with two-stage translation) and the privilege the entries are filled in.
+// Every context gets an id which is put into the bits above the guest
+// virtual page number, so switching between contexts only changes the tag
+// of the lookup instead of flushing the host TLB. Ids are not reused until
+// they run out and everything is flushed, therefore dropping a context from
+// the cache is enough to invalidate its entries.
+#define HOSTTLB_CTX_SHIFT (sizeof(vaddr_t) * 8 - PAGE_SHIFT)
+#define HOSTTLB_NR_CTX ((1 << PAGE_SHIFT) - 1) // the all-ones id is left out to keep (vaddr_t)-1 invalid
+#define HOSTTLB_CTX_CACHE_SIZE 256
+
+typedef struct {
+  uint64_t space, gspace, priv;
+  vaddr_t tag; // id of the context shifted into place, -1 if the slot is free
+} HostTLBContext;
+
+static HART_LOCAL HostTLBContext hosttlb_ctx_cache[HOSTTLB_CTX_CACHE_SIZE];
+static HART_LOCAL int hosttlb_nr_ctx = 0;
+static HART_LOCAL uint64_t hosttlb_space = 0, hosttlb_gspace = 0, hosttlb_priv = 0;
+static HART_LOCAL vaddr_t hosttlb_ctx = 0;
+static HART_LOCAL vaddr_t hosttlb_ctx_set = 0; // the same page of different contexts is put into different sets
 
 static inline vaddr_t hosttlb_vpn(vaddr_t vaddr) {
   return (vaddr >> PAGE_SHIFT);
 }
 
+static inline vaddr_t hosttlb_tag(vaddr_t vaddr) {
+  return hosttlb_vpn(vaddr) | hosttlb_ctx;
+}
+
+static inline int hosttlb_ctx_idx(vaddr_t vaddr, vaddr_t ctx_set) {
+  return ((hosttlb_vpn(vaddr) ^ ctx_set) % HOSTTLB_SIZE);
+}
+
 static inline int hosttlb_idx(vaddr_t vaddr) {
-  return (hosttlb_vpn(vaddr) % HOSTTLB_SIZE);
+  return hosttlb_ctx_idx(vaddr, hosttlb_ctx_set);
+}
+
+#ifdef CONFIG_USE_SPARSEMM
+// The entries of sparse memory point to the host block of the page. The
+// next page is in another block, so an access crossing pages must not use
+// the entry.
+#define hosttlb_cross_page(vaddr, len) (((vaddr) & PAGE_MASK) + (len) > PAGE_SIZE)
+#else
+#define hosttlb_cross_page(vaddr, len) false
+#endif
+
+static inline vaddr_t hosttlb_set_of(vaddr_t tag) {
+  return (tag >> HOSTTLB_CTX_SHIFT) * 97;
+}
+
+// Superpages are also kept in small tables indexed by the 2 MiB and the
+// 1 GiB page number, which are checked when the 4 KiB entry misses. A page
+// larger than that fills the entry of the 2 MiB or 1 GiB part of it which
+// is accessed. The ISA reports the size of the page found by the last
+// translation in hosttlb_page_shift, or 0 if the page must not be cached.
+#define HOSTTLB_SP_SIZE 256
+#define HOSTTLB_SP_LEVELS 2
+static const int hosttlb_sp_shift[HOSTTLB_SP_LEVELS] = { 21, 30 };
+static HART_LOCAL HostTLBEntry hostsptlb[3][HOSTTLB_SP_LEVELS][HOSTTLB_SP_SIZE];
+HART_LOCAL int hosttlb_page_shift = PAGE_SHIFT;
+
+// A flush of any page in a superpage drops the whole superpage, so the
+// entries remember the size of the leaf PTE they are filled from, which
+// may be larger than the size they cache. The ISA reports it in
+// hosttlb_leaf_shift.
+static HART_LOCAL uint8_t hosttlb_leaf[ARRLEN(hosttlb)];
+static HART_LOCAL uint8_t hostsptlb_leaf[3][HOSTTLB_SP_LEVELS][HOSTTLB_SP_SIZE];
+static HART_LOCAL bool hosttlb_has_superpage = false; // since the last hosttlb_flush_all()
+HART_LOCAL int hosttlb_leaf_shift = PAGE_SHIFT;
+
+static inline uint8_t *hosttlb_leaf_of(HostTLBEntry *e) {
+  if (e >= hosttlb && e < hosttlb + ARRLEN(hosttlb)) return &hosttlb_leaf[e - hosttlb];
+  return &hostsptlb_leaf[0][0][0] + (e - &hostsptlb[0][0][0]);
+}
+
+static inline void hosttlb_set_leaf(HostTLBEntry *e, int leaf_shift) {
+  *hosttlb_leaf_of(e) = leaf_shift;
+  if (leaf_shift > PAGE_SHIFT) hosttlb_has_superpage = true;
+}
+
+static inline int hosttlb_sp_type(int type) {
+  return (type == MEM_TYPE_IFETCH ? 2 : type == MEM_TYPE_WRITE ? 1 : 0);
+}
+
+static inline HostTLBEntry *hosttlb_sp_entry(int t, int level, vaddr_t vaddr, vaddr_t ctx_set) {
+  vaddr_t spn = vaddr >> hosttlb_sp_shift[level];
+  return &hostsptlb[t][level][(spn ^ ctx_set) % HOSTTLB_SP_SIZE];
+}
+
+static inline HostTLBEntry *hosttlb_sp_lookup(int type, vaddr_t vaddr) {
+  int t = hosttlb_sp_type(type);
+  for (int i = 0; i < HOSTTLB_SP_LEVELS; i ++) {
+    HostTLBEntry *e = hosttlb_sp_entry(t, i, vaddr, hosttlb_ctx_set);
+    if (e->gvpn == ((vaddr >> hosttlb_sp_shift[i]) | hosttlb_ctx)) return e;
+  }
+  return NULL;
+}
+
+static void hosttlb_fill(HostTLBEntry *e, int type, vaddr_t vaddr, paddr_t paddr) {
+#ifdef CONFIG_USE_SPARSEMM
+  // The blocks of sparse memory are only contiguous within a page, so
+  // superpages are not cached.
+  uint8_t *host = sparse_mem_host_addr(get_sparsemm(), paddr & ~PAGE_MASK, PAGE_SIZE);
+  if (host != NULL) {
+    e->offset = host - (vaddr & ~PAGE_MASK);
+    e->gvpn = hosttlb_tag(vaddr);
+    hosttlb_set_leaf(e, hosttlb_leaf_shift);
+  }
+#else
+  e->offset = guest_to_host(paddr) - vaddr;
+  e->gvpn = hosttlb_tag(vaddr);
+  hosttlb_set_leaf(e, hosttlb_leaf_shift);
+  for (int i = HOSTTLB_SP_LEVELS - 1; i >= 0; i --) {
+    int shift = hosttlb_sp_shift[i];
+    paddr_t base = paddr & ~(((paddr_t)1 << shift) - 1);
+    if (hosttlb_page_shift < shift || !in_pmem(base) || !in_pmem(base + ((paddr_t)1 << shift) - 1)) continue;
+    HostTLBEntry *sp = hosttlb_sp_entry(hosttlb_sp_type(type), i, vaddr, hosttlb_ctx_set);
+    sp->offset = e->offset;
+    sp->gvpn = (vaddr >> shift) | hosttlb_ctx;
+    hosttlb_set_leaf(sp, hosttlb_leaf_shift);
+    break;
+  }
+#endif
+}
+
+static void hosttlb_flush_all() {
+  memset(hosttlb, -1, sizeof(hosttlb));
+  memset(hostsptlb, -1, sizeof(hostsptlb));
+  memset(hosttlb_ctx_cache, -1, sizeof(hosttlb_ctx_cache));
+  hosttlb_nr_ctx = 0;
+  memset(hosttlb_leaf, 0, sizeof(hosttlb_leaf));
+  memset(hostsptlb_leaf, 0, sizeof(hostsptlb_leaf));
+  hosttlb_has_superpage = false;
+}
+
+static void hosttlb_switch_context() {
+  uint64_t h = hosttlb_space ^ (hosttlb_space >> 44) ^ hosttlb_gspace ^ (hosttlb_gspace >> 44) ^
+    (hosttlb_priv * 0x9e3779b97f4a7c15ull);
+  HostTLBContext *c = &hosttlb_ctx_cache[(h ^ (h >> 32)) % HOSTTLB_CTX_CACHE_SIZE];
+  if (c->tag == (vaddr_t)-1 || c->space != hosttlb_space || c->gspace != hosttlb_gspace ||
+      c->priv != hosttlb_priv) {
+    if (hosttlb_nr_ctx == HOSTTLB_NR_CTX) hosttlb_flush_all();
+    c->space = hosttlb_space;
+    c->gspace = hosttlb_gspace;
+    c->priv = hosttlb_priv;
+    c->tag = (vaddr_t)(hosttlb_nr_ctx ++) << HOSTTLB_CTX_SHIFT;
+  }
+  hosttlb_ctx = c->tag;
+  hosttlb_ctx_set = hosttlb_set_of(c->tag);
+}
+
+void hosttlb_set_context(uint64_t space, uint64_t gspace, uint64_t priv) {
+  if (space == hosttlb_space && gspace == hosttlb_gspace && priv == hosttlb_priv) return;
+  hosttlb_space = space;
+  hosttlb_gspace = gspace;
+  hosttlb_priv = priv;
+  hosttlb_switch_context();
+}
+
+void hosttlb_flush_context(uint64_t space_mask, uint64_t space) {
+  for (int i = 0; i < HOSTTLB_CTX_CACHE_SIZE; i ++) {
+    HostTLBContext *c = &hosttlb_ctx_cache[i];
+    if (c->tag != (vaddr_t)-1 && (c->space & space_mask) == space) c->tag = (vaddr_t)-1;
+  }
+  hosttlb_switch_context();
+}
+
+// whether the entry caching the page number `gvpn` of pages of `shift` is in
+// the leaf of `leaf_shift` which contains vaddr, regardless of the context
+static inline bool hosttlb_in_leaf(vaddr_t gvpn, int shift, vaddr_t vaddr, int leaf_shift) {
+  vaddr_t pn = gvpn & (((vaddr_t)1 << HOSTTLB_CTX_SHIFT) - 1);
+  return ((pn << shift) >> leaf_shift) == (vaddr >> leaf_shift);
+}
+
+// Drop the entries filled from a superpage which contains vaddr. The other
+// pages of the superpage are in any set, so all entries are checked.
+static void hosttlb_flush_superpage(vaddr_t vaddr) {
+  for (int i = 0; i < ARRLEN(hosttlb); i ++) {
+    int leaf_shift = hosttlb_leaf[i];
+    if (leaf_shift > PAGE_SHIFT && hosttlb_in_leaf(hosttlb[i].gvpn, PAGE_SHIFT, vaddr, leaf_shift)) {
+      hosttlb[i].gvpn = (sword_t)-1;
+    }
+  }
+  for (int t = 0; t < 3; t ++) {
+    for (int l = 0; l < HOSTTLB_SP_LEVELS; l ++) {
+      for (int i = 0; i < HOSTTLB_SP_SIZE; i ++) {
+        HostTLBEntry *e = &hostsptlb[t][l][i];
+        int leaf_shift = hostsptlb_leaf[t][l][i];
+        if (leaf_shift > hosttlb_sp_shift[l] && hosttlb_in_leaf(e->gvpn, hosttlb_sp_shift[l], vaddr, leaf_shift)) {
+          e->gvpn = (sword_t)-1;
+        }
+      }
+    }
+  }
 }
 
 void hosttlb_flush(vaddr_t vaddr) {
   if (vaddr == 0) {
-    memset(hosttlb, -1, sizeof(hosttlb));
+    hosttlb_flush_all();
+    hosttlb_switch_context();
   } else {
-    vaddr_t gvpn = hosttlb_vpn(vaddr);
-    int idx = hosttlb_idx(vaddr);
-    if (hostrtlb[idx].gvpn == gvpn) hostrtlb[idx].gvpn = (sword_t)-1;
-    if (hostwtlb[idx].gvpn == gvpn) hostwtlb[idx].gvpn = (sword_t)-1;
-    if (hostxtlb[idx].gvpn == gvpn) hostxtlb[idx].gvpn = (sword_t)-1;
+    // the page is dropped in all contexts in the cache, the others can not be hit
+    for (int i = 0; i < HOSTTLB_CTX_CACHE_SIZE; i ++) {
+      vaddr_t tag = hosttlb_ctx_cache[i].tag;
+      if (tag == (vaddr_t)-1) continue;
+      vaddr_t gvpn = hosttlb_vpn(vaddr) | tag;
+      int idx = hosttlb_ctx_idx(vaddr, hosttlb_set_of(tag));
+      if (hostrtlb[idx].gvpn == gvpn) hostrtlb[idx].gvpn = (sword_t)-1;
+      if (hostwtlb[idx].gvpn == gvpn) hostwtlb[idx].gvpn = (sword_t)-1;
+      if (hostxtlb[idx].gvpn == gvpn) hostxtlb[idx].gvpn = (sword_t)-1;
+      for (int t = 0; t < 3; t ++) {
+        for (int l = 0; l < HOSTTLB_SP_LEVELS; l ++) {
+          HostTLBEntry *e = hosttlb_sp_entry(t, l, vaddr, hosttlb_set_of(tag));
+          if (e->gvpn == ((vaddr >> hosttlb_sp_shift[l]) | tag)) e->gvpn = (sword_t)-1;
+        }
+      }
+    }
+    if (hosttlb_has_superpage) hosttlb_flush_superpage(vaddr);
   }
 }
 
+void hosttlb_flush_write() {
+  for (int i = 0; i < HOSTTLB_SIZE; i ++) hostwtlb[i].gvpn = (sword_t)-1;
+  memset(hostsptlb[hosttlb_sp_type(MEM_TYPE_WRITE)], -1, sizeof(hostsptlb[0]));
+}
+
+#ifdef CONFIG_ENGINE_JIT
+void hosttlb_jit_info(HostTLBJitInfo *info) {
+  static_assert(sizeof(HostTLBEntry) == 16 && offsetof(HostTLBEntry, gvpn) == 8,
+      "the JIT expects the layout of HostTLBEntry");
+  info->rtlb = hostrtlb;
+  info->wtlb = hostwtlb;
+  info->ctx = &hosttlb_ctx;
+  info->ctx_set = &hosttlb_ctx_set;
+  info->size = HOSTTLB_SIZE;
+}
+#endif
+
 void hosttlb_init() {
   hosttlb_flush(0);
 }
@@ -63,6 +284,8 @@ static paddr_t va2pa(struct Decode *s, vaddr_t vaddr, int len, int type) {
   if (type != MEM_TYPE_IFETCH) save_globals(s);
   // int ret = isa_mmu_check(vaddr, len, type);
   // if (ret == MMU_DIRECT) return vaddr;
+  hosttlb_page_shift = PAGE_SHIFT;
+  hosttlb_leaf_shift = PAGE_SHIFT;
   paddr_t pg_base = isa_mmu_translate(vaddr, len, type);
   int ret = pg_base & PAGE_MASK;
   assert(ret == MEM_RET_OK);
@@ -71,79 +294,74 @@ static paddr_t va2pa(struct Decode *s, vaddr_t vaddr, int len, int type) {
 
 __attribute__((noinline))
 static word_t hosttlb_read_slowpath(struct Decode *s, vaddr_t vaddr, int len, int type) {
+  HostTLBEntry *e = type == MEM_TYPE_IFETCH ?
+    &hostxtlb[hosttlb_idx(vaddr)] : &hostrtlb[hosttlb_idx(vaddr)];
+  HostTLBEntry *sp = hosttlb_sp_lookup(type, vaddr);
+  if (sp != NULL) {
+    e->offset = sp->offset;
+    e->gvpn = hosttlb_tag(vaddr);
+    hosttlb_set_leaf(e, *hosttlb_leaf_of(sp));
+    return host_read(e->offset + vaddr, len);
+  }
   paddr_t paddr = va2pa(s, vaddr, len, type);
   word_t data = paddr_read(paddr, len, type, cpu.mode, vaddr);
-  if (likely(in_pmem(paddr))) {
-    HostTLBEntry *e = type == MEM_TYPE_IFETCH ?
-      &hostxtlb[hosttlb_idx(vaddr)] : &hostrtlb[hosttlb_idx(vaddr)];
-    #ifdef CONFIG_USE_SPARSEMM
-    e->offset = (uint8_t *)(paddr - vaddr);
-    #else
-    e->offset = guest_to_host(paddr) - vaddr;
-    #endif
-    e->gvpn = hosttlb_vpn(vaddr);
-  }
+  if (likely(in_pmem(paddr) && hosttlb_page_shift != 0)) hosttlb_fill(e, type, vaddr, paddr);
   Logtr("Slowpath, vaddr " FMT_WORD " --> paddr: " FMT_PADDR, vaddr, paddr);
   return data;
 }
 
 __attribute__((noinline))
 static void hosttlb_write_slowpath(struct Decode *s, vaddr_t vaddr, int len, word_t data) {
+  HostTLBEntry *e = &hostwtlb[hosttlb_idx(vaddr)];
+  HostTLBEntry *sp = hosttlb_sp_lookup(MEM_TYPE_WRITE, vaddr);
+  if (sp != NULL) {
+    e->offset = sp->offset;
+    e->gvpn = hosttlb_tag(vaddr);
+    hosttlb_set_leaf(e, *hosttlb_leaf_of(sp));
+    // the other fills follow paddr_write(), which marks the page
+    IFDEF(CONFIG_PMEM_DIRTY_TRACK, pmem_dirty_mark(host_to_guest(e->offset + vaddr), len));
+    host_write(e->offset + vaddr, len, data);
+    return;
+  }
   paddr_t paddr = va2pa(s, vaddr, len, MEM_TYPE_WRITE);
   paddr_write(paddr, len, data, cpu.mode, vaddr);
-  if (likely(in_pmem(paddr))) {
-    HostTLBEntry *e = &hostwtlb[hosttlb_idx(vaddr)];
-    #ifdef CONFIG_USE_SPARSEMM
-    e->offset = (uint8_t *)(paddr - vaddr);
-    #else
-    e->offset = guest_to_host(paddr) - vaddr;
-    #endif
-    e->gvpn = hosttlb_vpn(vaddr);
-  }
+  if (likely(in_pmem(paddr) && hosttlb_page_shift != 0)) hosttlb_fill(e, MEM_TYPE_WRITE, vaddr, paddr);
 }
 
 word_t hosttlb_read(struct Decode *s, vaddr_t vaddr, int len, int type) {
   Logm("hosttlb_reading " FMT_WORD, vaddr);
 #ifdef CONFIG_RVH
-  extern bool has_two_stage_translation();
-  if(has_two_stage_translation()){
+  extern bool hosttlb_bypass_two_stage();
+  if(hosttlb_bypass_two_stage()){
     paddr_t paddr = va2pa(s, vaddr, len, type);
     return paddr_read(paddr, len, type, cpu.mode, vaddr);
   }
 #endif
-  vaddr_t gvpn = hosttlb_vpn(vaddr);
+  vaddr_t gvpn = hosttlb_tag(vaddr);
   HostTLBEntry *e = type == MEM_TYPE_IFETCH ?
     &hostxtlb[hosttlb_idx(vaddr)] : &hostrtlb[hosttlb_idx(vaddr)];
-  if (unlikely(e->gvpn != gvpn)) {
+  if (unlikely(e->gvpn != gvpn || hosttlb_cross_page(vaddr, len))) {
     Logm("Host TLB slow path");
     return hosttlb_read_slowpath(s, vaddr, len, type);
   } else {
     Logm("Host TLB fast path");
-    #ifdef CONFIG_USE_SPARSEMM
-    return sparse_mem_wread(get_sparsemm(), (vaddr_t)e->offset + vaddr, len);
-    #else
     return host_read(e->offset + vaddr, len);
-    #endif
   }
 }
 
 void hosttlb_write(struct Decode *s, vaddr_t vaddr, int len, word_t data) {
   #ifdef CONFIG_RVH
-  extern bool has_two_stage_translation();
-  if(has_two_stage_translation()){
+  extern bool hosttlb_bypass_two_stage();
+  if(hosttlb_bypass_two_stage()){
     paddr_t paddr = va2pa(s, vaddr, len, MEM_TYPE_WRITE);
     return paddr_write(paddr, len, data, cpu.mode, vaddr);
   }
 #endif
-  vaddr_t gvpn = hosttlb_vpn(vaddr);
+  vaddr_t gvpn = hosttlb_tag(vaddr);
   HostTLBEntry *e = &hostwtlb[hosttlb_idx(vaddr)];
-  if (unlikely(e->gvpn != gvpn)) {
+  if (unlikely(e->gvpn != gvpn || hosttlb_cross_page(vaddr, len))) {
     hosttlb_write_slowpath(s, vaddr, len, data);
     return;
   }
-  #ifdef CONFIG_USE_SPARSEMM
-  sparse_mem_wwrite(get_sparsemm(), (vaddr_t)e->offset + vaddr, len, data);
-  #else
   host_write(e->offset + vaddr, len, data);
-  #endif
 }
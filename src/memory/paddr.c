@@ -17,6 +17,8 @@
 #include <isa.h>
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <memory/host-tlb.h>
 #include <memory/sparseram.h>
 #include <device/mmio.h>
 #include <stdlib.h>
@@ -38,9 +40,17 @@ unsigned int PMEM_HARTID = 0;
 
 #ifdef CONFIG_USE_MMAP
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 static uint8_t *pmem = NULL;
+#ifndef CONFIG_USE_SPARSEMM
+int pmem_hugepage = MUXDEF(CONFIG_PMEM_HUGEPAGE_THP, PMEM_HUGEPAGE_THP,
+    MUXDEF(CONFIG_PMEM_HUGEPAGE_HUGETLB, PMEM_HUGEPAGE_HUGETLB, PMEM_HUGEPAGE_NONE));
+bool pmem_populate = ISDEF(CONFIG_PMEM_POPULATE);
+int pmem_numa_node = CONFIG_PMEM_NUMA_NODE;
+#endif
 #elif CONFIG_ENABLE_MEM_DEDUP
 // When memory deduplication is enabled, the pmem is allocated by DUT
 static uint8_t *pmem = NULL;
@@ -88,6 +98,68 @@ void * get_sparsemm(){
 uint8_t* guest_to_host(paddr_t paddr) { return paddr + HOST_PMEM_OFFSET; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - HOST_PMEM_OFFSET; }
 
+#ifdef CONFIG_PMEM_DIRTY_TRACK
+// One bit for every page of pmem. Stores which hit the host TLB do not come
+// here, so the page is marked before its write entry is filled, and the
+// write entries are flushed when the bitmap is cleared.
+static uint64_t *pmem_dirty = NULL;
+static uint64_t pmem_nr_page = 0;
+
+static inline void pmem_dirty_set(uint64_t page) {
+  uint64_t *w = &pmem_dirty[page / 64];
+  uint64_t bit = 1ull << (page % 64);
+  // only write the bitmap when the page is clean
+  if (!(*w & bit)) *w |= bit;
+}
+
+void pmem_dirty_mark(paddr_t addr, size_t len) {
+  if (len == 0) return;
+  uint64_t first = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  uint64_t last = (addr - CONFIG_MBASE + len - 1) >> PAGE_SHIFT;
+  for (uint64_t page = first; page <= last && page < pmem_nr_page; page ++) {
+    pmem_dirty_set(page);
+  }
+}
+
+bool pmem_dirty_test(paddr_t addr) {
+  uint64_t page = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  return (pmem_dirty[page / 64] >> (page % 64)) & 1;
+}
+
+uint64_t pmem_dirty_next(paddr_t addr) {
+  uint64_t page = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  while (page < pmem_nr_page) {
+    uint64_t w = pmem_dirty[page / 64] >> (page % 64);
+    if (w != 0) {
+      page += __builtin_ctzll(w);
+      return page < pmem_nr_page ? CONFIG_MBASE + (page << PAGE_SHIFT) : PMEM_DIRTY_NONE;
+    }
+    page = (page / 64 + 1) * 64;
+  }
+  return PMEM_DIRTY_NONE;
+}
+
+uint64_t pmem_dirty_count() {
+  uint64_t n = 0;
+  for (uint64_t i = 0; i < (pmem_nr_page + 63) / 64; i ++) {
+    n += __builtin_popcountll(pmem_dirty[i]);
+  }
+  return n;
+}
+
+void pmem_dirty_clear() {
+  memset(pmem_dirty, 0, (pmem_nr_page + 63) / 64 * sizeof(pmem_dirty[0]));
+  // the next store to every page should be marked again
+  hosttlb_flush_write();
+}
+
+static void init_pmem_dirty() {
+  pmem_nr_page = MEMORY_SIZE >> PAGE_SHIFT;
+  pmem_dirty = calloc((pmem_nr_page + 63) / 64, sizeof(pmem_dirty[0]));
+  Assert(pmem_dirty != NULL, "Can not allocate the dirty page bitmap");
+}
+#endif
+
 static inline word_t pmem_read(paddr_t addr, int len) {
 #ifdef CONFIG_MEMORY_REGION_ANALYSIS
   analysis_memory_commit(addr);
@@ -100,6 +172,7 @@ static inline word_t pmem_read(paddr_t addr, int len) {
 }
 
 static inline void pmem_write(paddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_PMEM_DIRTY_TRACK, pmem_dirty_set((addr - CONFIG_MBASE) >> PAGE_SHIFT));
 #ifdef CONFIG_DIFFTEST_STORE_COMMIT
   store_commit_queue_push(addr, data, len);
 #endif
@@ -128,6 +201,24 @@ static inline void raise_read_access_fault(int type, vaddr_t vaddr) {
   raise_access_fault(cause, vaddr);
 }
 
+#if defined(CONFIG_USE_MMAP) && !defined(CONFIG_USE_SPARSEMM)
+void pmem_apply_policy(void *addr, size_t len) {
+  if (pmem_hugepage == PMEM_HUGEPAGE_THP && madvise(addr, len, MADV_HUGEPAGE) != 0) {
+    Log("madvise(MADV_HUGEPAGE) for guest memory failed: %s", strerror(errno));
+  }
+  if (pmem_numa_node >= 0) {
+    // MPOL_BIND, the headers of libnuma are not required for the syscall
+    unsigned long nodemask[16] = {};
+    Assert(pmem_numa_node < (int)sizeof(nodemask) * 8, "Invalid NUMA node %d", pmem_numa_node);
+    nodemask[pmem_numa_node / 64] = 1ul << (pmem_numa_node % 64);
+    if (syscall(SYS_mbind, addr, len, 2, nodemask, sizeof(nodemask) * 8, 0) != 0) {
+      Log("Can not bind guest memory to NUMA node %d: %s", pmem_numa_node, strerror(errno));
+      pmem_numa_node = -1;
+    }
+  }
+}
+#endif
+
 void allocate_memory_with_mmap()
 {
 #ifdef CONFIG_USE_MMAP
@@ -139,19 +230,51 @@ void allocate_memory_with_mmap()
   // allocated only once at the first time called.
   // See https://man7.org/linux/man-pages/man2/mmap.2.html for details.
   void *pmem_base = (void *)(PMEMBASE + PMEM_HARTID * MEMORY_SIZE);
-  void *ret = mmap(pmem_base, MEMORY_SIZE, PROT_READ | PROT_WRITE,
-      MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+  uint64_t start = get_time();
+  // With THP or NUMA binding, the pages are faulted in after madvise() or
+  // mbind(), otherwise they would already be allocated as normal pages or
+  // on the current node.
+  bool populate_later = pmem_populate &&
+    (pmem_hugepage == PMEM_HUGEPAGE_THP || pmem_numa_node >= 0);
+  int flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED;
+  if (pmem_populate && !populate_later) flags |= MAP_POPULATE;
+  void *ret = MAP_FAILED;
+  if (pmem_hugepage == PMEM_HUGEPAGE_HUGETLB) {
+    ret = mmap(pmem_base, MEMORY_SIZE, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (ret == MAP_FAILED) {
+      Log("Can not allocate guest memory from hugetlbfs (%s), use normal pages instead",
+          strerror(errno));
+      pmem_hugepage = PMEM_HUGEPAGE_NONE;
+    }
+  }
+  if (ret == MAP_FAILED) {
+    ret = mmap(pmem_base, MEMORY_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+  }
   if (ret != pmem_base) {
     perror("mmap");
     assert(0);
   }
   pmem = ret;
+
+  pmem_apply_policy(pmem, MEMORY_SIZE);
+  if (populate_later) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (unsigned long i = 0; i < MEMORY_SIZE; i += page_size) {
+      ((volatile uint8_t *)pmem)[i] = 0;
+    }
+  }
+
+  const char *hugepage[] = { "normal pages", "transparent huge pages", "hugetlbfs" };
+  Log("Allocated %lu MiB guest memory with %s%s, NUMA node %d, in %lu ms",
+      MEMORY_SIZE >> 20, hugepage[pmem_hugepage], pmem_populate ? " (populated)" : "",
+      pmem_numa_node, (get_time() - start) / 1000);
   #endif
 #endif // CONFIG_USE_MMAP
 }
 
 void init_mem() {
   allocate_memory_with_mmap();
+  IFDEF(CONFIG_PMEM_DIRTY_TRACK, init_pmem_dirty());
 #ifdef CONFIG_DIFFTEST_STORE_COMMIT
   for (int i = 0; i < CONFIG_DIFFTEST_STORE_QUEUE_SIZE; i++) {
     store_commit_queue[i].valid = 0;
@@ -223,7 +346,7 @@ word_t paddr_read(paddr_t addr, int len, int type, int mode, vaddr_t vaddr) {
 #ifdef CONFIG_STORE_LOG
 #ifdef CONFIG_LIGHTQS
 
-extern uint64_t g_nr_guest_instr;
+extern HART_LOCAL uint64_t g_nr_guest_instr;
 
 extern uint64_t stable_log_begin, spec_log_begin;
 
@@ -0,0 +1,153 @@
+/***************************************************************************************
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <cpu/cpu.h>
+#include <difftest.h>
+#include <checkpoint/sparse_cpt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef CONFIG_PMEM_SNAPSHOT
+
+// Copy-on-write snapshot of the guest physical memory. Taking a snapshot
+// makes pmem read only. The first write to a page after that faults, and the
+// SIGSEGV handler saves the page to the shadow memory and makes it writable.
+// Resetting to the snapshot copies back only the pages written since the
+// last reset, and makes them read only again. The saved pages are kept, so
+// they are copied from pmem only once for every snapshot.
+//
+// All writes to pmem by NEMU are tracked, including the ones by the host TLB
+// fast path and devices, since they all go through the host page protection.
+// But the host kernel can not write to the protected pages, e.g. by read(2),
+// so the snapshot should be dropped before that.
+//
+// Only the memory, cpu and CSRs are in the snapshot, the devices are not.
+
+static uint8_t *pmem_base = NULL;
+static uint8_t *shadow = NULL;      // saved pages, at the same offsets as pmem
+static uint8_t *saved = NULL;       // saved[i]: page i is in the shadow
+static uint32_t *dirty = NULL;      // pages written since the last reset
+static uint64_t nr_dirty = 0;
+static uint64_t nr_page = 0;
+static long page_size = 0;
+static CPU_state cpu_snapshot;
+static word_t csr_snapshot[4096];
+static struct sigaction old_action;
+
+static void snapshot_segv_handler(int sig, siginfo_t *info, void *ucontext) {
+  uint8_t *addr = info->si_addr;
+  if (shadow == NULL || addr < pmem_base || addr >= pmem_base + MEMORY_SIZE) {
+    // not a write to pmem, let the old handler do it
+    sigaction(SIGSEGV, &old_action, NULL);
+    return;
+  }
+  uint64_t i = (addr - pmem_base) / page_size;
+  uint8_t *page = pmem_base + i * page_size;
+  if (!saved[i]) {
+    memcpy(shadow + i * page_size, page, page_size);
+    saved[i] = 1;
+  }
+  dirty[nr_dirty ++] = i;
+  mprotect(page, page_size, PROT_READ | PROT_WRITE);
+}
+
+static int cmp_page(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// drop the snapshot and make pmem writable again
+void pmem_snapshot_drop() {
+  if (shadow == NULL) return;
+  munmap(shadow, MEMORY_SIZE);
+  shadow = NULL;
+  free(saved);
+  free(dirty);
+  mprotect(pmem_base, MEMORY_SIZE, PROT_READ | PROT_WRITE);
+}
+
+void pmem_snapshot_take() {
+  extern int pmem_hugepage;
+  Assert(pmem_hugepage != PMEM_HUGEPAGE_HUGETLB,
+      "Snapshots of guest memory backed by hugetlbfs are not supported");
+  pmem_snapshot_drop();
+  // the lazily restored pages are not accessible, which the snapshot can not tell
+  IFDEF(CONFIG_CPT_LAZY_RESTORE, sparse_cpt_lazy_fill(guest_to_host(CONFIG_MBASE), MEMORY_SIZE));
+
+  pmem_base = guest_to_host(CONFIG_MBASE);
+  page_size = sysconf(_SC_PAGESIZE);
+  nr_page = MEMORY_SIZE / page_size;
+  // the shadow memory is only allocated by the host when a page is saved
+  shadow = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  Assert(shadow != MAP_FAILED, "Can not allocate the shadow memory for the snapshot");
+  saved = calloc(nr_page, sizeof(saved[0]));
+  dirty = malloc(nr_page * sizeof(dirty[0]));
+  nr_dirty = 0;
+
+  static bool handler_installed = false;
+  if (!handler_installed) {
+    struct sigaction action = {};
+    action.sa_sigaction = snapshot_segv_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    int ret = sigaction(SIGSEGV, &action, &old_action);
+    Assert(ret == 0, "Can not install the SIGSEGV handler for the snapshot");
+    handler_installed = true;
+  }
+
+  cpu_snapshot = cpu;
+  isa_difftest_csrcpy(csr_snapshot, DIFFTEST_TO_DUT);
+  int ret = mprotect(pmem_base, MEMORY_SIZE, PROT_READ);
+  Assert(ret == 0, "Can not protect guest memory for the snapshot");
+  Log("Took a snapshot of %lu MiB guest memory", MEMORY_SIZE >> 20);
+}
+
+void pmem_snapshot_reset() {
+  Assert(shadow != NULL, "No snapshot is taken");
+  uint64_t start = get_time();
+  uint64_t n = nr_dirty;
+  // protect the contiguous dirty pages together
+  qsort(dirty, nr_dirty, sizeof(dirty[0]), cmp_page);
+  for (uint64_t j = 0, run = 0; j < nr_dirty; j ++) {
+    uint64_t i = dirty[j];
+    memcpy(pmem_base + i * page_size, shadow + i * page_size, page_size);
+    IFDEF(CONFIG_PMEM_DIRTY_TRACK, pmem_dirty_mark(host_to_guest(pmem_base + i * page_size), page_size));
+    if (j + 1 == nr_dirty || dirty[j + 1] != i + 1) {
+      uint64_t first = dirty[run];
+      mprotect(pmem_base + first * page_size, (i - first + 1) * page_size, PROT_READ);
+      run = j + 1;
+    }
+  }
+  nr_dirty = 0;
+
+  cpu = cpu_snapshot;
+  isa_difftest_csrcpy(csr_snapshot, DIFFTEST_TO_REF);
+  // the translations and decoded instructions may be from the memory
+  // written after the snapshot
+  mmu_tlb_flush(0);
+  hart_set_pc(cpu.pc);
+  // so that the guest can run again after it has halted
+  if (nemu_state.state == NEMU_END || nemu_state.state == NEMU_ABORT) {
+    nemu_state.state = NEMU_STOP;
+  }
+  Log("Reset to the snapshot, %lu pages are copied back in %lu us", n, get_time() - start);
+}
+
+#endif
@@ -17,6 +17,7 @@
 #include <map>
 #include <memory>
 #include <cerrno>
+#include <algorithm>
 
 /*******************************************Comm Functions****************************************************************/
 
@@ -384,76 +385,111 @@ int file_is_elf(const char *fn){
 
 SparseRam::~SparseRam()
 {
-  for (auto iter = this->mem.begin(); iter != this->mem.end(); iter++)
+  this->_for_each_blk([](paddr_t index, u_int8_t *blk) { free(blk); });
+  for (paddr_t i = 0; i < (1ul << RADIX_ROOT_BITS); i++)
   {
-    free(iter->second);
+    auto mid = this->root[i];
+    if (mid == NULL)
+    {
+      continue;
+    }
+    for (paddr_t j = 0; j < (1ul << RADIX_MID_BITS); j++)
+    {
+      free(mid[j]);
+    }
+    free(mid);
   }
+  free(this->root);
   for (auto iter = this->big_block.begin(); iter != this->big_block.end(); iter++){
     free(iter->second->blk);
     free(iter->second);
   }
-  this->mem.clear();
-  this->cache.clear();
   this->big_block.clear();
 }
 
-void SparseRam::__update_cache(paddr_t index, u_int8_t *m)
+inline u_int8_t *SparseRam::_blk_lookup(paddr_t index)
 {
-
-  paddr_t big_index = 0;
-  u_long big_time = 0;
-
-  for (auto c = this->cache.begin(); c != this->cache.end(); c++)
+  if (likely(index == this->last_index))
   {
-    auto tdata = c->second;
-    auto c_mem = std::get<0>(tdata);
-    auto c_tim = std::get<1>(tdata);
-    if (c_tim > big_time)
-    {
-      big_time = c_tim;
-      big_index = c->first;
-    }
-    std::tuple<u_int8_t *, u_long> ndata = std::make_tuple(c_mem, c_tim + 1);
-    c->second = ndata;
+    return this->last_blk;
   }
-
-  std::tuple<u_int8_t *, u_long> a = std::make_tuple(m, 1);
-  this->cache[index] = a;
-
-  if (this->cache.size() < this->max_cache_size)
+  auto root_idx = index >> (RADIX_MID_BITS + RADIX_LEAF_BITS);
+  if (unlikely(root_idx >= (1ul << RADIX_ROOT_BITS)))
   {
-    return;
+    return NULL;
+  }
+  auto mid = this->root[root_idx];
+  if (mid == NULL)
+  {
+    return NULL;
+  }
+  auto leaf = mid[(index >> RADIX_LEAF_BITS) & ((1ul << RADIX_MID_BITS) - 1)];
+  if (leaf == NULL)
+  {
+    return NULL;
+  }
+  auto blk = leaf[index & ((1ul << RADIX_LEAF_BITS) - 1)];
+  if (blk != NULL)
+  {
+    this->last_index = index;
+    this->last_blk = blk;
   }
-  // need replace: remove biggest tim
-  vassert(big_index != 0, "find oldest item fail!");
-  cache.erase(big_index);
+  return blk;
 }
 
-bool SparseRam::_fast_count(paddr_t index)
+u_int8_t *SparseRam::_blk_alloc(paddr_t index)
 {
-  if (this->cache.count(index))
+  auto blk = this->_blk_lookup(index);
+  if (likely(blk != NULL))
   {
-    return true;
+    return blk;
+  }
+  auto root_idx = index >> (RADIX_MID_BITS + RADIX_LEAF_BITS);
+  vassert(root_idx < (1ul << RADIX_ROOT_BITS), sfmt("address 0x%lx out of range", index << this->block_shift));
+  auto &mid = this->root[root_idx];
+  if (mid == NULL)
+  {
+    mid = (mid_table)calloc(1ul << RADIX_MID_BITS, sizeof(leaf_table));
   }
-  // miss
-  auto ret = this->mem.count(index);
-  if (ret)
+  auto &leaf = mid[(index >> RADIX_LEAF_BITS) & ((1ul << RADIX_MID_BITS) - 1)];
+  if (leaf == NULL)
   {
-    this->__update_cache(index, this->mem[index]);
+    leaf = (leaf_table)calloc(1ul << RADIX_LEAF_BITS, sizeof(u_int8_t *));
   }
-  return ret;
+  blk = (u_int8_t *)calloc(this->block_size, sizeof(u_int8_t));
+  leaf[index & ((1ul << RADIX_LEAF_BITS) - 1)] = blk;
+  this->nr_blk++;
+  this->last_index = index;
+  this->last_blk = blk;
+  return blk;
 }
 
-u_int8_t *SparseRam::_fast_mem(paddr_t index)
+// visit the blocks in the order of their addresses
+void SparseRam::_for_each_blk(std::function<void (paddr_t index, u_int8_t *blk)> handler)
 {
-  if (this->cache.count(index))
+  for (paddr_t i = 0; i < (1ul << RADIX_ROOT_BITS); i++)
   {
-    return std::get<0>(this->cache[index]);
+    auto mid = this->root[i];
+    if (mid == NULL)
+    {
+      continue;
+    }
+    for (paddr_t j = 0; j < (1ul << RADIX_MID_BITS); j++)
+    {
+      auto leaf = mid[j];
+      if (leaf == NULL)
+      {
+        continue;
+      }
+      for (paddr_t k = 0; k < (1ul << RADIX_LEAF_BITS); k++)
+      {
+        if (leaf[k] != NULL)
+        {
+          handler((((i << RADIX_MID_BITS) | j) << RADIX_LEAF_BITS) | k, leaf[k]);
+        }
+      }
+    }
   }
-  // miss
-  auto ret = this->mem[index];
-  __update_cache(index, ret);
-  return ret;
 }
 
 bool SparseRam::load_bin(const char *file, paddr_t addr)
@@ -493,35 +529,23 @@ void SparseRam::read(paddr_t addr, size_t len, void *bytes)
     return;
   }
 
-  auto index_start = addr / this->block_size;
-  auto offst_start = addr % this->block_size;
-  auto offst_end = offst_start + len;
-  auto index_count = 1;
-  auto lenrm = len - (this->block_size - offst_start);
-
-  if (unlikely(lenrm > 0))
+  auto buff = (u_int8_t *)bytes;
+  while (len > 0)
   {
-    offst_end = lenrm % this->block_size;
-    index_count += lenrm / this->block_size;
-    if (likely(offst_end != 0))
+    auto offset = addr & (this->block_size - 1);
+    auto size = std::min<size_t>(len, this->block_size - offset);
+    auto blk = this->_blk_lookup(addr >> this->block_shift);
+    if (blk != NULL)
     {
-      index_count += 1;
+      memcpy(buff, blk + offset, size);
     }
-  }
-
-  auto i = 0;
-  auto buff = (u_int8_t *)bytes;
-  for (auto idx = 0; idx < index_count; idx++)
-  {
-    auto base = index_start + idx;
-    auto empt = !this->_fast_count(base);
-    auto of_start = idx == 0 ? offst_start : 0;
-    auto of_end = idx == index_count - 1 ? offst_end : this->block_size;
-    for (auto p = of_start; p < of_end; p++)
+    else
     {
-      buff[i] = empt ? 0 : this->_fast_mem(base)[p];
-      i += 1;
+      memset(buff, 0, size);
     }
+    addr += size;
+    buff += size;
+    len -= size;
   }
 }
 
@@ -543,43 +567,39 @@ void SparseRam::write(paddr_t addr, size_t len, const void *bytes)
     return;
   }
 
-  auto index_start = addr / this->block_size;
-  auto offst_start = addr % this->block_size;
-  auto offst_end = offst_start + len;
-  auto lenrm = len - (this->block_size - offst_start);
-  auto index_count = 1;
-
-  if (unlikely(lenrm > 0))
+  auto buff = (const u_int8_t *)bytes;
+  while (len > 0)
   {
-    offst_end = lenrm % this->block_size;
-    index_count += lenrm / this->block_size;
-    if (likely(offst_end != 0))
-    {
-      index_count += 1;
-    }
+    auto offset = addr & (this->block_size - 1);
+    auto size = std::min<size_t>(len, this->block_size - offset);
+    memcpy(this->_blk_alloc(addr >> this->block_shift) + offset, buff, size);
+    addr += size;
+    buff += size;
+    len -= size;
   }
+}
 
-  auto i = 0;
-  auto buff = (u_int8_t *)bytes;
-  for (auto idx = 0; idx < index_count; idx++)
+// Return the host address of [addr, addr + len), which must be in one block.
+// The block is allocated if it is not written yet, so the address can be
+// cached and written by the caller. Return NULL if the range is not in one
+// block.
+void *SparseRam::host_addr(paddr_t addr, size_t len)
+{
+  auto blk = this->_blk_find(addr);
+  if (blk != NULL)
   {
-    auto base = index_start + idx;
-    if (unlikely(!this->_fast_count(base)))
-    {
-      this->mem[base] = (u_int8_t *)calloc(this->block_size, sizeof(u_int8_t));
-    }
-    auto of_start = idx == 0 ? offst_start : 0;
-    auto of_end = idx == index_count - 1 ? offst_end : this->block_size;
-    for (auto p = of_start; p < of_end; p++)
-    {
-      this->_fast_mem(base)[p] = buff[i];
-      i += 1;
-    }
+    return blk->end >= addr + len ? blk->blk + (addr - blk->start) : NULL;
+  }
+  auto offset = addr & (this->block_size - 1);
+  if (offset + len > this->block_size)
+  {
+    return NULL;
   }
+  return this->_blk_alloc(addr >> this->block_shift) + offset;
 }
 
 bool SparseRam::add_blk(char *name, paddr_t start, paddr_t end){
-  vassert(this->mem.empty(), "should first init big_blocks. not write mem");
+  vassert(this->nr_blk == 0, "should first init big_blocks. not write mem");
   vassert(end > start, "big_block size need > 0");
   auto blk_name = std::string(name);
   vassert(!this->big_block.count(blk_name), "big_block is existed");
@@ -638,7 +658,20 @@ word_t SparseRam::read(paddr_t addr, int len)
 {
   vassert(len <= 8, "len error");
   u_int8_t buff[8];
-  this->read(addr, 8, (void *)buff);
+  auto offset = addr & (this->block_size - 1);
+  if (likely(offset + len <= this->block_size && this->big_block.empty()))
+  {
+    auto blk = this->_blk_lookup(addr >> this->block_shift);
+    if (blk == NULL)
+    {
+      return 0;
+    }
+    memcpy(buff, blk + offset, len);
+  }
+  else
+  {
+    this->read(addr, len, (void *)buff);
+  }
 
   switch (len) {
     case 1: return *(uint8_t  *)buff;
@@ -662,7 +695,13 @@ void SparseRam::write(paddr_t addr, int len, word_t data)
     IFDEF(CONFIG_ISA64, case 8: *(uint64_t *)buff = data; break);
     IFDEF(CONFIG_RT_CHECK, default: assert(0));
   }
-  return this->write(addr, len, (const void *)buff);
+  auto offset = addr & (this->block_size - 1);
+  if (likely(offset + len <= this->block_size && this->big_block.empty()))
+  {
+    memcpy(this->_blk_alloc(addr >> this->block_shift) + offset, buff, len);
+    return;
+  }
+  return this->write(addr, (size_t)len, (const void *)buff);
 }
 
 endianness_t SparseRam::get_target_endianness()
@@ -672,10 +711,8 @@ endianness_t SparseRam::get_target_endianness()
 
 void SparseRam::copy_nzero_bytes(copy_mem_func copy_handler)
 {
-  for (auto iter = this->mem.begin(); iter != this->mem.end(); iter++)
-  {
-    auto addr = iter->first * this->block_size;
-    auto buff = iter->second;
+  this->_for_each_blk([&](paddr_t index, u_int8_t *buff) {
+    auto addr = index << this->block_shift;
     u_int astart = 0;
     for (u_int i = 0; i < this->block_size; i++)
     {
@@ -693,7 +730,7 @@ void SparseRam::copy_nzero_bytes(copy_mem_func copy_handler)
     {
       copy_handler(addr + astart, this->block_size - astart, &buff[astart]);
     }
-  }
+  });
 }
 
 void SparseRam::copy(SparseRam *dst) {
@@ -726,18 +763,15 @@ void SparseRam::copy_bytes(copy_mem_func copy_handler)
     copy_handler(sbk->start, sbk->end - sbk->start, sbk->blk);
   }
   // copy norm mem
-  for (auto iter = this->mem.begin(); iter != this->mem.end(); iter++)
-  {
-    auto addr = iter->first * this->block_size;
-    auto buff = iter->second;
-    copy_handler(addr, this->block_size, buff);
-  }
+  this->_for_each_blk([&](paddr_t index, u_int8_t *buff) {
+    copy_handler(index << this->block_shift, this->block_size, buff);
+  });
 }
 
 void SparseRam::print_info()
 {
   OUTPUT(stderr, "SpRam blocks: %ld, size: %.2f MB\n", 
-         this->mem.size(), float(this->mem.size() * this->block_size) / (1024.0 * 1024.0));
+         this->nr_blk, float(this->nr_blk * this->block_size) / (1024.0 * 1024.0));
 }
 
 /*******************************************Export CAPIs****************************************************************/
@@ -788,6 +822,12 @@ word_t sparse_mem_wread(void *self, paddr_t addr, int len)
   return m->read(addr, len);
 }
 
+void *sparse_mem_host_addr(void *self, paddr_t addr, size_t len)
+{
+  auto m = (SparseRam *)self;
+  return m->host_addr(addr, len);
+}
+
 void sparse_mem_info(void *self)
 {
   auto m = (SparseRam *)self;
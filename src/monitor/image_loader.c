@@ -14,6 +14,8 @@
 ***************************************************************************************/
 
 #include <assert.h>
+#include <checkpoint/cpt_env.h>
+#include <checkpoint/sparse_cpt.h>
 #include <fcntl.h>
 #include <isa.h>
 #include <macro.h>
@@ -206,6 +208,15 @@ long load_img(char* img_name, char *which_img, uint64_t load_start, size_t img_s
     return 4096;  // built-in image size
   }
 
+  if (is_sparse_cpt_file(loading_img)) {
+#ifdef CONFIG_MEM_COMPRESS
+    Log("Loading sparse checkpoint %s", loading_img);
+    return sparse_cpt_load(loading_img, guest_to_host(RESET_VECTOR), MEMORY_SIZE, cpt_compress_threads);
+#else
+    panic("CONFIG_MEM_COMPRESS is disabled, turn it on in memuconfig!");
+#endif
+  }
+
   if (is_gz_file(loading_img)) {
 #ifdef CONFIG_MEM_COMPRESS
     Log("Loading GZ image %s", loading_img);
@@ -252,6 +263,8 @@ long load_img(char* img_name, char *which_img, uint64_t load_start, size_t img_s
     munmap(buf, size);
   }
 #else
+  // fread() can not fault in the lazily restored pages
+  IFDEF(CONFIG_CPT_LAZY_RESTORE, sparse_cpt_lazy_fill(guest_to_host(load_start), size));
   int ret = fread(guest_to_host(load_start), size, 1, fp);
   assert(ret == 1);
 #endif
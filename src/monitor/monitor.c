@@ -42,6 +42,9 @@ static int batch_mode = false;
 static int difftest_port = 1234;
 char *max_instr = NULL;
 char compress_file_format = 0; // default is gz
+int cpt_compress_threads = MUXDEF(CONFIG_MEM_COMPRESS, CONFIG_CPT_COMPRESS_THREADS, 0);
+int cpt_async_dumps = MUXDEF(CONFIG_MEM_COMPRESS, CONFIG_CPT_ASYNC_DUMPS, 0);
+int cpt_delta_chain = MUXDEF(CONFIG_PMEM_DIRTY_TRACK, MUXDEF(CONFIG_MEM_COMPRESS, CONFIG_CPT_DELTA_CHAIN, 0), 0);
 
 extern char *mapped_cpt_file;  // defined in paddr.c
 extern bool map_image_as_output_cpt;
@@ -50,6 +53,14 @@ extern char *mem_dump_file;
 #ifdef CONFIG_MEMORY_REGION_ANALYSIS
 extern char *memory_region_record_file;
 #endif
+#ifdef CONFIG_PERF_OPT
+extern uint64_t tcache_size; // defined in tcache.c
+#endif
+#if defined(CONFIG_USE_MMAP) && !defined(CONFIG_USE_SPARSEMM)
+extern int pmem_hugepage;    // defined in paddr.c
+extern bool pmem_populate;
+extern int pmem_numa_node;
+#endif
 int is_batch_mode() { return batch_mode; }
 
 static inline void welcome() {
@@ -75,6 +86,7 @@ void sig_handler(int signum) {
     } else {
       panic("Received SIGINT when not waiting for it");
     }
+    update_per_bb_hook();
   } else {
     panic("Unhandled signal: %i\n", signum);
   }
@@ -108,6 +120,9 @@ static inline int parse_args(int argc, char *argv[]) {
     {"cpt-mmode"          , no_argument      , NULL, 7},
     {"map-cpt"            , required_argument, NULL, 10},
     {"checkpoint-format"  , required_argument, NULL, 12},
+    {"cpt-compress-threads", required_argument, NULL, 18},
+    {"cpt-async-dumps"    , required_argument, NULL, 19},
+    {"cpt-delta-chain"    , required_argument, NULL, 20},
 
     // profiling
     {"simpoint-profile"   , no_argument      , NULL, 3},
@@ -123,6 +138,14 @@ static inline int parse_args(int argc, char *argv[]) {
     // small log file
     {"small-log"          , required_argument, NULL, 8},
 
+    // trace cache
+    {"tcache-size"        , required_argument, NULL, 14},
+
+    // guest physical memory
+    {"pmem-hugepage"      , required_argument, NULL, 15},
+    {"pmem-populate"      , no_argument      , NULL, 16},
+    {"pmem-numa-node"     , required_argument, NULL, 17},
+
     {0          , 0                , NULL,  0 },
   };
   int o;
@@ -232,15 +255,53 @@ static inline int parse_args(int argc, char *argv[]) {
           compress_file_format = GZ_FORMAT;
         } else if (!strcmp(optarg, "zstd")) {
           compress_file_format = ZSTD_FORMAT;
+        } else if (!strcmp(optarg, "sparse")) {
+          compress_file_format = SPARSE_FORMAT;
         } else {
           xpanic("Not support '%s' format\n", optarg);
         }
         break;
+      case 18: sscanf(optarg, "%d", &cpt_compress_threads); break;
+      case 19: sscanf(optarg, "%d", &cpt_async_dumps); break;
+      case 20:
+#ifndef CONFIG_CPT_DELTA_CHAIN
+        xpanic("Delta checkpoints need CONFIG_MEM_COMPRESS and CONFIG_PMEM_DIRTY_TRACK\n");
+#endif
+        sscanf(optarg, "%d", &cpt_delta_chain);
+        break;
       case 8:
         log_file = optarg;
         small_log = true;
         break;
 
+      case 14:
+#ifdef CONFIG_PERF_OPT
+        sscanf(optarg, "%lu", &tcache_size);
+#else
+        Log("tcache size is set but CONFIG_PERF_OPT is not turned on");
+#endif
+        break;
+
+#if defined(CONFIG_USE_MMAP) && !defined(CONFIG_USE_SPARSEMM)
+      case 15:
+        if (!strcmp(optarg, "none")) {
+          pmem_hugepage = PMEM_HUGEPAGE_NONE;
+        } else if (!strcmp(optarg, "thp")) {
+          pmem_hugepage = PMEM_HUGEPAGE_THP;
+        } else if (!strcmp(optarg, "hugetlb")) {
+          pmem_hugepage = PMEM_HUGEPAGE_HUGETLB;
+        } else {
+          xpanic("Not support '%s' huge pages\n", optarg);
+        }
+        break;
+      case 16: pmem_populate = true; break;
+      case 17: sscanf(optarg, "%d", &pmem_numa_node); break;
+#else
+      case 15: case 16: case 17:
+        Log("guest memory options are set but it is not allocated by mmap()");
+        break;
+#endif
+
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
         printf("\t-b,--batch              run with batch mode\n");
@@ -264,7 +325,10 @@ static inline int parse_args(int argc, char *argv[]) {
         printf("\t--cpt-mmode             force to take cpt in mmode, which might not work.\n");
         printf("\t--manual-oneshot-cpt    Manually take one-shot cpt by send signal.\n");
         printf("\t--manual-uniform-cpt    Manually take uniform cpt by send signal.\n");
-        printf("\t--checkpoint-format     Specify the checkpoint format('gz' or 'zstd'), default: 'gz'.\n");
+        printf("\t--checkpoint-format     Specify the checkpoint format('gz', 'zstd' or 'sparse'), default: 'gz'.\n");
+        printf("\t--cpt-compress-threads=N (de)compress checkpoints with N threads, 0 for all host CPUs\n");
+        printf("\t--cpt-async-dumps=N     dump at most N checkpoints in the background, 0 to dump in place\n");
+        printf("\t--cpt-delta-chain=N     dump up to N uniform checkpoints as deltas after a full one, 0 for no delta\n");
 //        printf("\t--map-cpt               map to this file as pmem, which can be treated as a checkpoint.\n"); //comming back soon
 
         printf("\t--simpoint-profile      simpoint profiling\n");
@@ -273,6 +337,10 @@ static inline int parse_args(int argc, char *argv[]) {
 //        printf("\t--cpt-id                checkpoint id\n");
         printf("\t-M,--dump-mem=DUMP_FILE dump memory into FILE\n");
         printf("\t-R,--dump-reg=DUMP_FILE dump register value into FILE\n");
+        printf("\t--tcache-size=N         max number of decoded instructions in trace cache\n");
+        printf("\t--pmem-hugepage=MODE    back guest memory with huge pages, MODE is 'none', 'thp' or 'hugetlb'\n");
+        printf("\t--pmem-populate         pre-fault guest memory at startup\n");
+        printf("\t--pmem-numa-node=N      bind guest memory to NUMA node N\n");
         printf("\n");
         exit(0);
     }
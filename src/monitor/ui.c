@@ -21,6 +21,7 @@
 #include <memory/paddr.h>
 #include <memory/vaddr.h>
 #include <cpu/difftest.h>
+#include <checkpoint/sparse_cpt.h>
 #endif
 
 #ifndef CONFIG_SHARE
@@ -185,6 +186,7 @@ static int cmd_save(char *args) {
     FILE *fp = fopen(arg, "w");
     assert(fp != NULL);
     fwrite(&cpu, sizeof(cpu), 1, fp);
+    IFDEF(CONFIG_CPT_LAZY_RESTORE, sparse_cpt_lazy_fill(guest_to_host(CONFIG_MBASE), MEMORY_SIZE));
     fwrite(guest_to_host(CONFIG_MBASE), MEMORY_SIZE, 1, fp);
     fclose(fp);
   }
@@ -202,13 +204,44 @@ static int cmd_load(char *args) {
   else {
     FILE *fp = fopen(arg, "r");
     assert(fp != NULL);
+    // fread() can not write to the memory protected by the snapshot
+    IFDEF(CONFIG_PMEM_SNAPSHOT, pmem_snapshot_drop());
+    IFDEF(CONFIG_CPT_LAZY_RESTORE, sparse_cpt_lazy_fill(guest_to_host(CONFIG_MBASE), MEMORY_SIZE));
     __attribute__((unused)) int ret;
     ret = fread(&cpu, sizeof(cpu), 1, fp);
     ret = fread(guest_to_host(CONFIG_MBASE), MEMORY_SIZE, 1, fp);
+    IFDEF(CONFIG_PMEM_DIRTY_TRACK, pmem_dirty_mark(CONFIG_MBASE, MEMORY_SIZE));
     fclose(fp);
   }
   return 0;
 }
+
+#ifdef CONFIG_PMEM_DIRTY_TRACK
+static int cmd_dirty(char *args) {
+  char *arg = strtok(NULL, " ");
+  if (arg != NULL && strcmp(arg, "clear") == 0) {
+    pmem_dirty_clear();
+  } else {
+    printf("%lu dirty pages", pmem_dirty_count());
+    uint64_t addr = pmem_dirty_next(CONFIG_MBASE);
+    if (addr != PMEM_DIRTY_NONE) printf(", the first one at " FMT_PADDR, (paddr_t)addr);
+    printf("\n");
+  }
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_PMEM_SNAPSHOT
+static int cmd_snapshot(char *args) {
+  pmem_snapshot_take();
+  return 0;
+}
+
+static int cmd_reset(char *args) {
+  pmem_snapshot_reset();
+  return 0;
+}
+#endif
 #else
 #endif
 
@@ -239,6 +272,13 @@ static struct {
   { "attach", "attach diff test", cmd_attach },
   { "save", "save snapshot", cmd_save },
   { "load", "load snapshot", cmd_load },
+#ifdef CONFIG_PMEM_DIRTY_TRACK
+  { "dirty", "dirty - count the pages written since the last clear; dirty clear - clear them", cmd_dirty },
+#endif
+#ifdef CONFIG_PMEM_SNAPSHOT
+  { "snapshot", "take a copy-on-write snapshot of memory and registers", cmd_snapshot },
+  { "reset", "reset memory and registers to the last snapshot", cmd_reset },
+#endif
 #endif
 #endif
   { "q", "Exit NEMU", cmd_q },
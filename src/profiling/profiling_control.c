@@ -15,11 +15,12 @@ bool donot_skip_boot=false;
 bool workload_loaded=false;
 
 void reset_inst_counters() {
-  extern uint64_t g_nr_guest_instr;
+  extern HART_LOCAL uint64_t g_nr_guest_instr;
   extern bool workload_loaded;
   Log("Start profiling, resetting inst count from %lu to 1, (n_remain_total will not be cleared)\n", g_nr_guest_instr);
   g_nr_guest_instr = 1;
   workload_loaded=true;
+  update_per_bb_hook();
 }
 
 #ifdef CONFIG_SHARE